@@ -0,0 +1,609 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+
+#define CAPTURE_BUFSIZE 65536
+#define MAX_VARINT 10
+
+struct capture {
+	int fd;
+	int64_t last_us;	/* timestamp of the previous event */
+	uint64_t written;
+	size_t len;
+	unsigned char buf[CAPTURE_BUFSIZE];
+};
+
+static int capture_flush(struct capture *c)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < c->len) {
+		n = write(c->fd, c->buf + off, c->len - off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		off += n;
+	}
+
+	c->written += c->len;
+	c->len = 0;
+
+	return 0;
+}
+
+/* Makes sure at least len bytes fit into the buffer */
+static int capture_reserve(struct capture *c, size_t len)
+{
+	if (c->len + len <= sizeof(c->buf))
+		return 0;
+	return capture_flush(c);
+}
+
+static void put_u8(struct capture *c, uint8_t v)
+{
+	c->buf[c->len++] = v;
+}
+
+static void put_u16(struct capture *c, uint16_t v)
+{
+	put_u8(c, v & 0xff);
+	put_u8(c, v >> 8);
+}
+
+static void put_i32(struct capture *c, int32_t v)
+{
+	uint32_t u = v;
+
+	put_u16(c, u & 0xffff);
+	put_u16(c, u >> 16);
+}
+
+/* LEB128, seven bits per byte with the top bit set on all but the last */
+static void put_varint(struct capture *c, uint64_t v)
+{
+	while (v >= 0x80) {
+		put_u8(c, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	put_u8(c, v);
+}
+
+/* Small negative numbers get small encodings too */
+static void put_zigzag(struct capture *c, int64_t v)
+{
+	put_varint(c, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static int put_record(struct capture *c, enum capture_tag tag,
+		      const void *data, size_t len)
+{
+	int rc;
+
+	rc = capture_reserve(c, 1 + MAX_VARINT + len);
+	if (rc)
+		return rc;
+
+	put_u8(c, tag);
+	put_varint(c, len);
+	memcpy(c->buf + c->len, data, len);
+	c->len += len;
+
+	return 0;
+}
+
+static int put_string(struct capture *c, enum capture_tag tag, const char *str)
+{
+	if (!str)
+		return 0;
+	return put_record(c, tag, str, strlen(str));
+}
+
+static int put_bits(struct capture *c, const struct libevdev *dev,
+		    unsigned int type, unsigned int max)
+{
+	unsigned char bits[1 + (KEY_CNT + 7) / 8] = {0};
+	unsigned int code;
+
+	bits[0] = type;
+	for (code = 0; code < max; code++)
+		if (libevdev_has_event_code(dev, type, code))
+			bits[1 + code / 8] |= 1 << (code % 8);
+
+	return put_record(c, CAPTURE_TAG_BITS, bits, 1 + (max + 7) / 8);
+}
+
+static int put_abs(struct capture *c, unsigned int code,
+		   const struct input_absinfo *abs)
+{
+	int rc;
+
+	rc = capture_reserve(c, 2 + MAX_VARINT + 2 + 6 * 4);
+	if (rc)
+		return rc;
+
+	put_u8(c, CAPTURE_TAG_ABS);
+	put_varint(c, 2 + 6 * 4);
+	put_u16(c, code);
+	put_i32(c, abs->value);
+	put_i32(c, abs->minimum);
+	put_i32(c, abs->maximum);
+	put_i32(c, abs->fuzz);
+	put_i32(c, abs->flat);
+	put_i32(c, abs->resolution);
+
+	return 0;
+}
+
+static int put_state(struct capture *c,
+		     const struct input_event *ev, int nevents)
+{
+	size_t len = (size_t)nevents * 7;
+	int i, rc;
+
+	rc = capture_reserve(c, 1 + MAX_VARINT + len);
+	if (rc)
+		return rc;
+	/* a state bigger than the whole buffer is not a real device */
+	if (c->len + 1 + MAX_VARINT + len > sizeof(c->buf))
+		return -EINVAL;
+
+	put_u8(c, CAPTURE_TAG_STATE);
+	put_varint(c, len);
+	for (i = 0; i < nevents; i++) {
+		put_u8(c, ev[i].type);
+		put_u16(c, ev[i].code);
+		put_i32(c, ev[i].value);
+	}
+
+	return 0;
+}
+
+static int put_description(struct capture *c,
+			   const struct libevdev *dev,
+			   int mtdev_slots,
+			   const struct input_event *state, int nstate)
+{
+	static const struct {
+		unsigned int type, max;
+	} types[] = {
+		{ EV_SYN, SYN_CNT },
+		{ EV_KEY, KEY_CNT },
+		{ EV_REL, REL_CNT },
+		{ EV_ABS, ABS_CNT },
+		{ EV_MSC, MSC_CNT },
+		{ EV_SW, SW_CNT },
+	};
+	unsigned char props[(INPUT_PROP_CNT + 7) / 8] = {0};
+	unsigned char id[8];
+	unsigned int i, code;
+	int rc = 0;
+
+	rc |= put_string(c, CAPTURE_TAG_NAME, libevdev_get_name(dev));
+	rc |= put_string(c, CAPTURE_TAG_PHYS, libevdev_get_phys(dev));
+	rc |= put_string(c, CAPTURE_TAG_UNIQ, libevdev_get_uniq(dev));
+
+	id[0] = libevdev_get_id_bustype(dev) & 0xff;
+	id[1] = libevdev_get_id_bustype(dev) >> 8;
+	id[2] = libevdev_get_id_vendor(dev) & 0xff;
+	id[3] = libevdev_get_id_vendor(dev) >> 8;
+	id[4] = libevdev_get_id_product(dev) & 0xff;
+	id[5] = libevdev_get_id_product(dev) >> 8;
+	id[6] = libevdev_get_id_version(dev) & 0xff;
+	id[7] = libevdev_get_id_version(dev) >> 8;
+	rc |= put_record(c, CAPTURE_TAG_ID, id, sizeof(id));
+
+	for (i = 0; i < INPUT_PROP_CNT; i++)
+		if (libevdev_has_property(dev, i))
+			props[i / 8] |= 1 << (i % 8);
+	rc |= put_record(c, CAPTURE_TAG_PROPS, props, sizeof(props));
+
+	for (i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+		if (libevdev_has_event_type(dev, types[i].type))
+			rc |= put_bits(c, dev, types[i].type, types[i].max);
+
+	for (code = 0; code < ABS_CNT; code++) {
+		const struct input_absinfo *abs;
+
+		if (!libevdev_has_event_code(dev, EV_ABS, code))
+			continue;
+		abs = libevdev_get_abs_info(dev, code);
+		rc |= put_abs(c, code, abs);
+	}
+
+	/* mtdev turns protocol A into slots, describe what is recorded */
+	if (mtdev_slots > 0 &&
+	    !libevdev_has_event_code(dev, EV_ABS, ABS_MT_SLOT)) {
+		struct input_absinfo slot = { .maximum = mtdev_slots - 1 },
+				     tracking_id = { .minimum = -1, .maximum = 0xffff };
+
+		rc |= put_abs(c, ABS_MT_SLOT, &slot);
+		if (!libevdev_has_event_code(dev, EV_ABS, ABS_MT_TRACKING_ID))
+			rc |= put_abs(c, ABS_MT_TRACKING_ID, &tracking_id);
+	}
+
+	if (nstate > 0)
+		rc |= put_state(c, state, nstate);
+
+	rc |= put_record(c, CAPTURE_TAG_END, NULL, 0);
+
+	return rc ? -EIO : 0;
+}
+
+struct capture *capture_create(const char *path,
+			       const struct libevdev *dev,
+			       int mtdev_slots,
+			       const struct input_event *state, int nstate)
+{
+	struct capture *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (c->fd < 0) {
+		free(c);
+		return NULL;
+	}
+
+	memcpy(c->buf, CAPTURE_MAGIC, 4);
+	c->len = 4;
+	put_u16(c, CAPTURE_VERSION);
+	put_u16(c, 0);
+
+	if (put_description(c, dev, mtdev_slots, state, nstate) != 0 ||
+	    capture_flush(c) != 0) {
+		close(c->fd);
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+int capture_write(struct capture *c,
+		  const struct input_event *ev, int nevents)
+{
+	int i, rc;
+
+	for (i = 0; i < nevents; i++) {
+		int64_t us = (int64_t)ev[i].time.tv_sec * 1000000 +
+			     ev[i].time.tv_usec;
+
+		rc = capture_reserve(c, 1 + 3 * MAX_VARINT);
+		if (rc)
+			return rc;
+
+		put_zigzag(c, us - c->last_us);
+		put_u8(c, ev[i].type);
+		put_varint(c, ev[i].code);
+		put_zigzag(c, ev[i].value);
+		c->last_us = us;
+	}
+
+	return 0;
+}
+
+uint64_t capture_close(struct capture *c)
+{
+	uint64_t written;
+
+	capture_flush(c);
+	close(c->fd);
+	written = c->written;
+	free(c);
+
+	return written;
+}
+
+struct capture_reader {
+	const unsigned char *data;
+	size_t size;
+	size_t pos;		/* of the next record or event */
+	size_t events;		/* offset of the first event */
+	int64_t last_us;
+};
+
+static int get_varint(struct capture_reader *r, uint64_t *v)
+{
+	unsigned int shift = 0;
+
+	*v = 0;
+	while (r->pos < r->size && shift < 64) {
+		uint8_t b = r->data[r->pos++];
+
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+		shift += 7;
+	}
+
+	return -1;
+}
+
+static int get_zigzag(struct capture_reader *r, int64_t *v)
+{
+	uint64_t u;
+
+	if (get_varint(r, &u))
+		return -1;
+	*v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+
+	return 0;
+}
+
+static unsigned int get_u16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static int32_t get_i32(const unsigned char *p)
+{
+	return (int32_t)(get_u16(p) | (uint32_t)get_u16(p + 2) << 16);
+}
+
+static char *get_string(const unsigned char *p, size_t len)
+{
+	return strndup((const char *)p, len);
+}
+
+/* Skips the description, remembering where the events start */
+static int skip_description(struct capture_reader *r)
+{
+	uint64_t len;
+	uint8_t tag;
+
+	do {
+		if (r->pos >= r->size)
+			return -1;
+		tag = r->data[r->pos++];
+		if (get_varint(r, &len) || len > r->size - r->pos)
+			return -1;
+		r->pos += len;
+	} while (tag != CAPTURE_TAG_END);
+
+	r->events = r->pos;
+
+	return 0;
+}
+
+struct capture_reader *capture_reader_open(const char *path)
+{
+	struct capture_reader *r;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < 8) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		close(fd);
+		return NULL;
+	}
+
+	r->size = st.st_size;
+	r->data = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (r->data == MAP_FAILED) {
+		free(r);
+		return NULL;
+	}
+
+	/* the whole file is read front to back exactly once */
+	madvise((void *)r->data, r->size, MADV_SEQUENTIAL);
+
+	if (memcmp(r->data, CAPTURE_MAGIC, 4) != 0 ||
+	    get_u16(r->data + 4) != CAPTURE_VERSION) {
+		capture_reader_close(r);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r->pos = 8;
+	if (skip_description(r) != 0) {
+		capture_reader_close(r);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return r;
+}
+
+struct libevdev *capture_reader_device(struct capture_reader *r)
+{
+	struct libevdev *dev;
+	uint64_t len;
+	unsigned int i;
+
+	dev = libevdev_new();
+	if (!dev)
+		return NULL;
+
+	r->pos = 8;
+	while (r->pos < r->events) {
+		const unsigned char *p;
+		uint8_t tag = r->data[r->pos++];
+		char *str;
+
+		if (get_varint(r, &len))
+			break;
+		p = r->data + r->pos;
+		r->pos += len;
+
+		switch (tag) {
+		case CAPTURE_TAG_NAME:
+			str = get_string(p, len);
+			libevdev_set_name(dev, str);
+			free(str);
+			break;
+		case CAPTURE_TAG_PHYS:
+			str = get_string(p, len);
+			libevdev_set_phys(dev, str);
+			free(str);
+			break;
+		case CAPTURE_TAG_UNIQ:
+			str = get_string(p, len);
+			libevdev_set_uniq(dev, str);
+			free(str);
+			break;
+		case CAPTURE_TAG_ID:
+			if (len < 8)
+				break;
+			libevdev_set_id_bustype(dev, get_u16(p));
+			libevdev_set_id_vendor(dev, get_u16(p + 2));
+			libevdev_set_id_product(dev, get_u16(p + 4));
+			libevdev_set_id_version(dev, get_u16(p + 6));
+			break;
+		case CAPTURE_TAG_PROPS:
+			for (i = 0; i < len * 8 && i < INPUT_PROP_CNT; i++)
+				if (p[i / 8] & (1 << (i % 8)))
+					libevdev_enable_property(dev, i);
+			break;
+		case CAPTURE_TAG_BITS:
+			if (len < 1)
+				break;
+			libevdev_enable_event_type(dev, p[0]);
+			/* axes need their absinfo, they come separately */
+			if (p[0] == EV_ABS)
+				break;
+			for (i = 0; i < (len - 1) * 8; i++)
+				if (p[1 + i / 8] & (1 << (i % 8)))
+					libevdev_enable_event_code(dev, p[0], i, NULL);
+			break;
+		case CAPTURE_TAG_ABS:
+			if (len >= 2 + 6 * 4) {
+				struct input_absinfo abs = {
+					.value = get_i32(p + 2),
+					.minimum = get_i32(p + 6),
+					.maximum = get_i32(p + 10),
+					.fuzz = get_i32(p + 14),
+					.flat = get_i32(p + 18),
+					.resolution = get_i32(p + 22),
+				};
+				libevdev_enable_event_code(dev, EV_ABS,
+							   get_u16(p), &abs);
+			}
+			break;
+		default:
+			/* newer writer, skip what we don't know */
+			break;
+		}
+	}
+
+	r->pos = r->events;
+	r->last_us = 0;
+
+	return dev;
+}
+
+int capture_reader_state(struct capture_reader *r,
+			 struct input_event *ev, int max)
+{
+	size_t pos = r->pos;
+	uint64_t len;
+	int n = 0;
+
+	r->pos = 8;
+	while (r->pos < r->events) {
+		const unsigned char *p;
+		uint8_t tag = r->data[r->pos++];
+
+		if (get_varint(r, &len))
+			break;
+		p = r->data + r->pos;
+		r->pos += len;
+
+		if (tag != CAPTURE_TAG_STATE)
+			continue;
+
+		for (; len >= 7 && n < max; len -= 7, p += 7, n++) {
+			memset(&ev[n], 0, sizeof(ev[n]));
+			ev[n].type = p[0];
+			ev[n].code = get_u16(p + 1);
+			ev[n].value = get_i32(p + 3);
+		}
+		break;
+	}
+	r->pos = pos;
+
+	return n;
+}
+
+int capture_read(struct capture_reader *r, struct input_event *ev, int max)
+{
+	int n = 0;
+
+	while (n < max && r->pos < r->size) {
+		int64_t dt, value;
+		uint64_t code;
+		uint8_t type;
+
+		if (get_zigzag(r, &dt) || r->pos >= r->size)
+			return -1;
+		type = r->data[r->pos++];
+		if (get_varint(r, &code) || get_zigzag(r, &value))
+			return -1;
+
+		r->last_us += dt;
+		ev[n].time.tv_sec = r->last_us / 1000000;
+		ev[n].time.tv_usec = r->last_us % 1000000;
+		ev[n].type = type;
+		ev[n].code = code;
+		ev[n].value = value;
+		n++;
+
+		if (type == EV_SYN && code == SYN_REPORT)
+			break;
+	}
+
+	return n;
+}
+
+void capture_reader_close(struct capture_reader *r)
+{
+	munmap((void *)r->data, r->size);
+	free(r);
+}
@@ -0,0 +1,97 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <linux/input.h>
+#include <libevdev/libevdev.h>
+
+/*
+ * Binary event capture, see mtview(1) for the layout.
+ *
+ * A capture file is a short header, the device description as a list of
+ * tagged records and then the event stream up to the end of the file.
+ * Events are appended as they are consumed, with the timestamp stored
+ * as the difference to the previous event, so a typical event takes
+ * four to six bytes instead of the 24 of a struct input_event.
+ */
+
+#define CAPTURE_MAGIC "MTVC"
+#define CAPTURE_VERSION 1
+
+enum capture_tag {
+	CAPTURE_TAG_END = 0,	/* end of the description */
+	CAPTURE_TAG_NAME,	/* string */
+	CAPTURE_TAG_PHYS,	/* string */
+	CAPTURE_TAG_UNIQ,	/* string */
+	CAPTURE_TAG_ID,		/* u16 bustype, vendor, product, version */
+	CAPTURE_TAG_PROPS,	/* property bitmask */
+	CAPTURE_TAG_BITS,	/* u8 event type, code bitmask */
+	CAPTURE_TAG_ABS,	/* u16 code, i32 value, min, max, fuzz, flat, resolution */
+	CAPTURE_TAG_STATE,	/* u8 type, u16 code, i32 value per event */
+};
+
+struct capture;
+
+/* Creates path and writes the description of dev to it. Protocol A
+ * devices are recorded after mtdev's conversion, pass the number of
+ * slots mtdev hands out so they are described as such. 0 otherwise.
+ * state is a frame of nstate events that sets up the contacts already
+ * down when recording starts, it may be empty */
+struct capture *capture_create(const char *path,
+			       const struct libevdev *dev,
+			       int mtdev_slots,
+			       const struct input_event *state, int nstate);
+
+/* Appends events to the capture. Returns 0 or a negative errno */
+int capture_write(struct capture *c,
+		  const struct input_event *ev, int nevents);
+
+/* Flushes and closes the capture, returns the number of bytes written */
+uint64_t capture_close(struct capture *c);
+
+struct capture_reader;
+
+/* Maps path and parses its header. Returns NULL and sets errno on
+ * failure */
+struct capture_reader *capture_reader_open(const char *path);
+
+/* A new fd-less libevdev device built from the recorded description.
+ * The caller frees it */
+struct libevdev *capture_reader_device(struct capture_reader *r);
+
+/* The state frame recorded with the description, up to max events of
+ * it. Their timestamps are left zero. Returns the number of events */
+int capture_reader_state(struct capture_reader *r,
+			 struct input_event *ev, int max);
+
+/* Decodes up to max events, stopping early after a SYN_REPORT so
+ * every call returns at most one frame. Returns the number of events,
+ * 0 at the end of the capture or -1 if the capture is corrupt */
+int capture_read(struct capture_reader *r, struct input_event *ev, int max);
+
+void capture_reader_close(struct capture_reader *r);
+
+#endif
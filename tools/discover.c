@@ -0,0 +1,161 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/input.h>
+
+#include "discover.h"
+
+#define SYS_CLASS_INPUT "/sys/class/input"
+#define EVENT_NODE_NAME "event"
+
+#define LONG_BITS (sizeof(unsigned long) * 8)
+#define NLONGS(x) (((x) + LONG_BITS - 1) / LONG_BITS)
+
+/* First line of the attribute, without the newline */
+static int read_attr(const char *node, const char *attr,
+		     char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int rc = -1;
+
+	snprintf(path, sizeof(path), "%s/%s/device/%s",
+		 SYS_CLASS_INPUT, node, attr);
+	fp = fopen(path, "re");
+	if (!fp)
+		return -1;
+
+	if (fgets(buf, len, fp)) {
+		buf[strcspn(buf, "\n")] = '\0';
+		rc = 0;
+	}
+	fclose(fp);
+
+	return rc;
+}
+
+/* Capability bitmaps are printed as space separated hex words, the most
+ * significant first and with leading zero words left out */
+static void read_bits(const char *node, const char *attr,
+		      unsigned long *bits, size_t nwords)
+{
+	unsigned long words[NLONGS(KEY_CNT)];
+	char buf[1024], *p, *end;
+	size_t i, n = 0;
+
+	memset(bits, 0, nwords * sizeof(*bits));
+	if (read_attr(node, attr, buf, sizeof(buf)) != 0)
+		return;
+
+	for (p = buf; n < NLONGS(KEY_CNT); p = end) {
+		words[n] = strtoul(p, &end, 16);
+		if (end == p)
+			break;
+		n++;
+	}
+
+	for (i = 0; i < n && i < nwords; i++)
+		bits[i] = words[n - 1 - i];
+}
+
+static int test_bit(const unsigned long *bits, int bit)
+{
+	return !!(bits[bit / LONG_BITS] & (1UL << (bit % LONG_BITS)));
+}
+
+/* 1 for a multitouch device, 0 for a single touch one, -1 for anything
+ * else */
+static int touch_capable(const char *node)
+{
+	unsigned long abs[NLONGS(ABS_CNT)], key[NLONGS(KEY_CNT)];
+
+	read_bits(node, "capabilities/abs", abs, NLONGS(ABS_CNT));
+	if (test_bit(abs, ABS_MT_POSITION_X) && test_bit(abs, ABS_MT_POSITION_Y))
+		return 1;
+
+	read_bits(node, "capabilities/key", key, NLONGS(KEY_CNT));
+	if (test_bit(abs, ABS_X) && test_bit(abs, ABS_Y) &&
+	    test_bit(key, BTN_TOUCH))
+		return 0;
+
+	return -1;
+}
+
+static int is_event_node(const struct dirent *dir)
+{
+	return strncmp(dir->d_name, EVENT_NODE_NAME,
+		       strlen(EVENT_NODE_NAME)) == 0;
+}
+
+int discover_devices(struct input_node **nodes)
+{
+	struct dirent **namelist;
+	struct input_node *n;
+	int i, nentries, count = 0, mt;
+
+	*nodes = NULL;
+
+	nentries = scandir(SYS_CLASS_INPUT, &namelist, is_event_node,
+			   versionsort);
+	if (nentries < 0)
+		return -1;
+
+	n = calloc(nentries ? nentries : 1, sizeof(*n));
+
+	for (i = 0; i < nentries; i++) {
+		const char *node = namelist[i]->d_name;
+
+		if (n && (mt = touch_capable(node)) >= 0) {
+			snprintf(n[count].path, sizeof(n[count].path),
+				 "/dev/input/%.20s", node);
+			n[count].number = atoi(node + strlen(EVENT_NODE_NAME));
+			n[count].mt = mt;
+			if (discover_name(node, n[count].name,
+					  sizeof(n[count].name)) != 0)
+				strcpy(n[count].name, "???");
+			count++;
+		}
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	if (!n)
+		return -1;
+
+	*nodes = n;
+
+	return count;
+}
+
+int discover_name(const char *node, char *name, size_t len)
+{
+	return read_attr(node, "name", name, len);
+}
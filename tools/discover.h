@@ -0,0 +1,54 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef DISCOVER_H
+#define DISCOVER_H
+
+#include <stddef.h>
+
+/*
+ * Finding touch devices without opening them.
+ *
+ * Everything here comes from the attributes under /sys/class/input, so
+ * a node we may not open, or one whose driver hangs, costs no more than
+ * any other and nothing is grabbed or woken up by looking at it.
+ */
+
+struct input_node {
+	char path[32];		/* /dev/input/eventN */
+	int number;		/* N */
+	int mt;			/* ABS_MT_POSITION_X and _Y, else ABS_X, ABS_Y
+				   and BTN_TOUCH */
+	char name[256];
+};
+
+/* Lists the event nodes that can be used as a touch device, ordered by
+ * number. Returns how many there are, 0 if there are none or -1 if
+ * sysfs could not be read. *nodes is for the caller to free */
+int discover_devices(struct input_node **nodes);
+
+/* The name of the device behind event node node (e.g. "event3"),
+ * read from sysfs. Returns 0 or -1 */
+int discover_name(const char *node, char *name, size_t len);
+
+#endif
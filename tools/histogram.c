@@ -0,0 +1,85 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "histogram.h"
+
+void histogram_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+/* The largest value that lands in a bucket */
+static uint64_t bucket_max(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < HIST_SUB)
+		return i;
+
+	shift = i / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double p)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = p / 100.0 * h->count;
+	if (rank >= h->count)
+		return h->max;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			break;
+	}
+
+	return bucket_max(i) < h->max ? bucket_max(i) : h->max;
+}
+
+void histogram_print(FILE *fp, const char *name, const struct histogram *h,
+		     double scale, const char *unit)
+{
+	if (h->count == 0) {
+		fprintf(fp, "%-16s no samples\n", name);
+		return;
+	}
+
+	fprintf(fp, "%-16s n=%-8llu mean %8.1f p50 %8.1f p90 %8.1f "
+		"p99 %8.1f p99.9 %8.1f max %8.1f %s\n",
+		name, (unsigned long long)h->count,
+		h->sum / h->count / scale,
+		histogram_percentile(h, 50) / scale,
+		histogram_percentile(h, 90) / scale,
+		histogram_percentile(h, 99) / scale,
+		histogram_percentile(h, 99.9) / scale,
+		h->max / scale, unit);
+}
@@ -0,0 +1,82 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Constant-memory histogram of non-negative values, in the manner of
+ * HdrHistogram: values below HIST_SUB are counted exactly, above that
+ * every power of two is split into HIST_SUB linear buckets, so any
+ * percentile is within 1/HIST_SUB (about 3%) of the real value.
+ * Adding a value is a count leading zeros and an increment.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t min, max;
+	double sum;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+void histogram_reset(struct histogram *h);
+
+static inline unsigned int histogram_bucket(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < HIST_SUB)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+	       ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void histogram_add(struct histogram *h, uint64_t v)
+{
+	h->buckets[histogram_bucket(v)]++;
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->sum += v;
+	h->count++;
+}
+
+/* The value below which p percent of all values lie, 0 if empty */
+uint64_t histogram_percentile(const struct histogram *h, double p);
+
+/* One line: count, mean, p50, p90, p99, p99.9 and max, all values
+ * divided by scale */
+void histogram_print(FILE *fp, const char *name, const struct histogram *h,
+		     double scale, const char *unit);
+
+#endif
@@ -29,11 +29,12 @@
 #include <mtdev.h>
 #include <libevdev/libevdev.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/extensions/XInput2.h>
+#include <X11/extensions/XShm.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <dirent.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -42,13 +43,54 @@
 #include <cairo.h>
 #include <cairo-xlib.h>
 #include <getopt.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+
+#include "capture.h"
+#include "raster.h"
+#include "sprite.h"
+#include "histogram.h"
+#include "stats.h"
+#include "discover.h"
+#include "publish.h"
 
 #define DEFAULT_WIDTH 200
 #define MIN_WIDTH 5
 #define DEFAULT_WIDTH_MULTIPLIER 5 /* if no major/minor give the actual size */
 
-#define DIM_TOUCH 32
+#define HEADLESS_WIDTH 1920
+#define HEADLESS_HEIGHT 1080
+
+#define DEV_INPUT_EVENT "/dev/input"
+#define EVENT_DEV_NAME "event"
+
+#define DIM_TOUCH 32 /* if the device doesn't tell */
+#define DIM_DEVICES 16
+#define DIM_EVENTS 256
+#define DIM_FRAMES 16 /* power of two */
+#define DIM_TRAIL 32
+#define DIM_SPRITES 64
+#define DIM_TOUCH_IDS 64 /* power of two */
+#define TILE_SIZE 64	/* px */
+#define FADE_RATE 60	/* Hz, unless --rate says otherwise */
+#define CANVAS_MAX 4096	/* px, per side of a device-sized canvas */
+
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
+#define LONG_BITS (sizeof(long) * 8)
+#define NLONGS(x) (((x) + LONG_BITS - 1) / LONG_BITS)
+
 
 static int opcode;
 
@@ -56,9 +98,45 @@ struct color {
 	float r, g, b;
 };
 
+/* The axes output_touch() looks at, anything else is dropped while
+ * decoding */
+enum touch_axis {
+	AXIS_X,
+	AXIS_Y,
+	AXIS_PRESSURE,
+	AXIS_TOUCH_MAJOR,
+	AXIS_TOUCH_MINOR,
+	AXIS_ORIENTATION,
+	AXIS_TRACKING_ID,
+	NAXES
+};
+
+static const char *const axis_names[NAXES] = {
+	"x", "y", "pressure", "touch_major", "touch_minor",
+	"orientation", "tracking_id",
+};
+
 struct touch_data {
 	int active;
-	int data[ABS_CNT];
+	int dirty;	/* changed since it was last drawn */
+	int axes[NAXES];
+};
+
+static const struct {
+	int code;
+	enum touch_axis axis;
+} mt_axes[] = {
+	{ ABS_MT_POSITION_X, AXIS_X },
+	{ ABS_MT_POSITION_Y, AXIS_Y },
+	{ ABS_MT_PRESSURE, AXIS_PRESSURE },
+	{ ABS_MT_TOUCH_MAJOR, AXIS_TOUCH_MAJOR },
+	{ ABS_MT_TOUCH_MINOR, AXIS_TOUCH_MINOR },
+	{ ABS_MT_ORIENTATION, AXIS_ORIENTATION },
+	{ ABS_MT_TRACKING_ID, AXIS_TRACKING_ID },
+}, st_axes[] = {
+	{ ABS_X, AXIS_X },
+	{ ABS_Y, AXIS_Y },
+	{ ABS_PRESSURE, AXIS_PRESSURE },
 };
 
 struct touch_info {
@@ -72,9 +150,12 @@ struct touch_info {
 	    has_touch_minor;
 
 	int ntouches;
-	struct touch_data touches[DIM_TOUCH];
+	struct touch_data *touches;
 	int current_slot;
 
+	/* evdev code to touch_data.axes index, -1 for unused codes */
+	signed char axis_map[ABS_CNT];
+
 	/* XI2 axis mapping */
 	int x_valuator;
 	int y_valuator;
@@ -83,7 +164,243 @@ struct touch_info {
 	int mt_minor_valuator;
 };
 
+/* When a frame passed each stage on its way to the render thread, in
+ * CLOCK_MONOTONIC ns. 0 where it isn't known */
+struct frame_times {
+	uint64_t kernel;	/* SYN_REPORT timestamp */
+	uint64_t read;		/* read() returned it */
+	uint64_t decoded;	/* handed to the render thread */
+};
+
+/* A completed frame as handed from the input to the render thread */
+struct frame {
+	struct frame_times times;
+	struct touch_info touch_info;
+};
+
+/* Single-producer/single-consumer ring of frames. The input thread only
+ * ever writes head, the render thread only ever writes tail, so neither
+ * side takes a lock or waits for the other. The eventfds are only
+ * written when the other side is, or may be, asleep */
+struct frame_queue {
+	alignas(64) atomic_uint head;
+	alignas(64) atomic_uint tail;
+
+	alignas(64) atomic_int sleeping;	/* render thread about to wait */
+	atomic_int stalled;		/* input thread found the ring full */
+	atomic_int done;		/* input thread has exited */
+	atomic_int stop;		/* render thread wants it to exit */
+	int wake_fd;			/* input -> render */
+	int space_fd;			/* render -> input */
+	int stop_fd;			/* render -> input */
+
+	/* input thread only */
+	struct frame pending;		/* newest frame that didn't fit */
+	int has_pending;
+	unsigned int nframes;
+
+	/* render thread only */
+	unsigned int nrendered;
+
+	struct frame frames[DIM_FRAMES];
+	struct touch_data *touches;	/* storage for all frames */
+};
+
+/* Reused across reads so the evdev path never allocates */
+struct event_buffer {
+	struct input_event raw[DIM_EVENTS];	/* straight from the kernel */
+	struct input_event events[DIM_EVENTS];	/* after mtdev */
+	int nevents;
+};
+
+/* How often the input thread hands a new summary to the overlay */
+#define STATS_PERIOD_NS 500000000
+
+/* The statistics summary as shown by the render thread */
+struct stats_overlay {
+	pthread_mutex_t lock;
+	atomic_int updated;		/* summary changed since drawn */
+	uint64_t published;		/* input thread only */
+	struct stats_summary summary;
+};
+
+/* An evdev node and whatever sits between it and handle_event() */
+struct device {
+	int fd;
+	struct libevdev *evdev;
+	struct mtdev *mtdev;	/* protocol A only, NULL otherwise */
+	struct touch_info touch_info;
+	struct frame_queue *queue;
+	struct capture *capture;	/* NULL unless recording */
+	const char *record;		/* its path */
+	struct capture_reader *replay;	/* instead of fd when replaying */
+	double speed;			/* of the replay, 0 is unthrottled */
+	struct event_buffer buf;
+
+	int dropped;		/* discarding until the next SYN_REPORT */
+	unsigned int ndropped;	/* number of SYN_DROPPED seen */
+
+	int monotonic;		/* event timestamps are CLOCK_MONOTONIC */
+	uint64_t read_ns;	/* when the current batch was read */
+
+	struct device_stats *stats;	/* NULL unless collecting */
+	struct stats_overlay *overlay;	/* NULL unless shown */
+	struct publisher *publisher;	/* NULL unless --publish */
+
+	/* events read but not decoded yet, see merge_events() */
+	int nraw, pos;		/* in buf.raw, or buf.events when replaying */
+	int full;		/* the read filled buf.raw, there may be more */
+	uint64_t next;		/* timestamp of the next frame, ns */
+};
+
+/* The devices one input thread reads, in the order they are drawn */
+struct device_set {
+	int ndevs;
+	struct device *devs[DIM_DEVICES];
+	int hotplug;	/* wait for devices that went away to come back */
+};
+
+/* Devices with undecoded events, ordered by the timestamp of their
+ * next frame */
+struct merge_heap {
+	int n;
+	struct device *devs[DIM_DEVICES];
+};
+
+enum dump_format {
+	DUMP_PNG,
+	DUMP_RAW,
+};
+
+/* How the devices share the canvas */
+enum layout {
+	LAYOUT_TILED,	/* side by side, each in its own column */
+	LAYOUT_OVERLAY,	/* each one covers all of it */
+};
+
+struct options {
+	int rate;	/* Hz, 0 renders every frame */
+	int trails;	/* connect intermediate positions */
+
+	int headless;	/* no X, render into memory only */
+	int width, height;	/* of the headless canvas */
+	const char *dump;	/* directory to write presented frames to */
+	enum dump_format dump_format;
+
+	const char *record;	/* capture file for the decoded events */
+	const char *raster;	/* contact rasterizer, NULL for cairo */
+	int no_shm;		/* copy frames to the server through the socket */
+	int latency;		/* measure and report per-stage latency */
+	int stats;		/* show report-rate statistics */
+	const char *stats_dump;	/* file to write them to on exit */
+	const char *publish;	/* shared memory object for the frames */
+	float canvas_scale;	/* canvas px per device unit, 0 for screen size */
+	cairo_format_t canvas_format;
+	int no_hotplug;		/* end when a device goes away */
+	int fade;		/* ms until a contact is gone, 0 keeps it */
+	double speed;		/* replay speed, 0 as fast as possible */
+	enum layout layout;	/* with more than one device */
+};
+
+/* Positions a contact went through since it was last drawn */
+struct trail {
+	int tracking_id;
+	int npoints;
+	float x[DIM_TRAIL], y[DIM_TRAIL];
+	float width;
+};
+
+/* Limits rendering to one frame per refresh period */
+struct pacer {
+	int fd;			/* timerfd, -1 if not pacing */
+	uint64_t period;	/* ns */
+	uint64_t last;		/* time of the last render */
+	int armed;
+	int pending;		/* input arrived since the last render */
+};
+
+enum latency_stage {
+	LAT_KERNEL,	/* event timestamp to read() */
+	LAT_DECODE,	/* read() to frame handed over */
+	LAT_QUEUE,	/* handed over to drawing started, incl. pacing */
+	LAT_DRAW,
+	LAT_PRESENT,	/* until the server processed it */
+	LAT_TOTAL,	/* oldest known stage to presented */
+	NLAT
+};
+
+static const char *latency_names[NLAT] = {
+	"kernel->read", "read->decoded", "decoded->draw",
+	"draw", "present", "total",
+};
+
+/* Steps the fade while any tile still has something to fade */
+struct fade {
+	int fd;			/* timerfd, -1 if not fading */
+	uint64_t period;	/* ns */
+	uint64_t duration;	/* ns until a contact is fully faded */
+	uint64_t last;		/* time of the last step */
+	uint64_t owed;		/* ns * 255 not faded yet, under a level */
+	int armed;
+};
+
+/* What the renderer remembers about each slot */
+struct slot {
+	int tracking_id;
+	struct color color;
+	uint32_t pixel;		/* color as ARGB32, for the rasterizer */
+	struct trail trail;
+};
+
+/* A device as the renderer sees it, one per device on the canvas */
+struct view {
+	/* latest state, contacts that still need drawing are dirty */
+	struct frame frame;
+	int fresh;		/* frame.times are of an undrawn frame */
+
+	int nslots;
+	struct slot *slots;
+
+	int range_x, range_y;	/* of the device */
+	float x, y;		/* canvas offset of its region */
+	float dx, dy;		/* canvas px per device unit */
+
+	struct stats_overlay *overlay;	/* NULL unless --stats */
+};
+
+struct rect {
+	int x, y, w, h;
+};
+
+/* The canvas in TILE_SIZE squares. Dirty tiles changed since the last
+ * present, occupied tiles hold more than the white background */
+struct tiles {
+	int nx, ny;
+	unsigned long *dirty;	/* bitmap */
+	unsigned int ndirty;
+	unsigned char *occupied;
+	unsigned int noccupied;
+	struct rect *rects;	/* for present(), at most one per tile */
+};
+
+struct windata;
+
+/* Gets the backing buffer to wherever frames are shown. Everything
+ * but init and present is optional */
+struct presenter {
+	const char *name;
+	int (*init)(struct windata *w);
+	void (*present)(struct windata *w, const struct rect *rects, int nrects);
+	int (*get_fd)(struct windata *w);	/* events to dispatch, or -1 */
+	void (*dispatch)(struct windata *w);
+	void (*term)(struct windata *w);
+	/* a canvas the presenter can show without copying, optional */
+	cairo_surface_t *(*create_surface)(struct windata *w);
+};
+
 struct windata {
+	const struct presenter *presenter;
+
 	Display *dsp;
 	Window win;
 	GC gc;
@@ -92,16 +409,42 @@ struct windata {
 	float off_x, off_y;
 	int width, height; /* of window */
 	unsigned long white, black;
-	struct color color[DIM_TOUCH];
-	int id[DIM_TOUCH];
+
+	/* one per device, set up by init_views() */
+	int nviews;
+	struct view *views;
 
 	/* buffer */
 	cairo_t *cr;
 	cairo_surface_t *surface;
+	cairo_format_t format;
+	int scaled;		/* to the window size on present */
+	const struct rasterizer *raster;	/* NULL draws contacts with cairo */
+	struct sprite_cache *sprites;		/* or from here, if set */
+	struct raster_image image;		/* surface's pixels */
 
 	/* window */
 	cairo_t *cr_win;
 	cairo_surface_t *surface_win;
+
+	/* MIT-SHM, the canvas lives in a segment shared with the server */
+	XImage *shm_image;
+	XShmSegmentInfo shm;
+
+	struct tiles tiles;
+
+	const struct rasterizer *fader;	/* for --fade */
+
+	/* headless */
+	FILE *dump;
+	unsigned int dump_seq;
+
+	/* render cost */
+	unsigned int nframes;
+	uint64_t draw_ns, present_ns;
+	struct histogram *latency;	/* NLAT of them with --latency */
+
+	const struct options *opts;
 };
 
 static int error(const char *fmt, ...)
@@ -146,48 +489,247 @@ static struct color new_color(struct windata *w)
 	return c;
 }
 
+static int tiles_init(struct tiles *t, int width, int height)
+{
+	t->nx = (width + TILE_SIZE - 1) / TILE_SIZE;
+	t->ny = (height + TILE_SIZE - 1) / TILE_SIZE;
+	t->dirty = calloc(NLONGS(t->nx * t->ny), sizeof(*t->dirty));
+	t->occupied = calloc(t->nx * t->ny, sizeof(*t->occupied));
+	t->rects = calloc(t->nx * t->ny, sizeof(*t->rects));
+
+	return (t->dirty && t->occupied && t->rects) ? 0 : -1;
+}
+
+static void tiles_destroy(struct tiles *t)
+{
+	free(t->dirty);
+	free(t->occupied);
+	free(t->rects);
+}
+
+static inline int tile_dirty(const struct tiles *t, int tx, int ty)
+{
+	int i = ty * t->nx + tx;
+
+	return !!(t->dirty[i / LONG_BITS] & (1UL << (i % LONG_BITS)));
+}
+
+static inline void tile_damage(struct tiles *t, int tx, int ty)
+{
+	int i = ty * t->nx + tx;
+
+	if (!tile_dirty(t, tx, ty)) {
+		t->dirty[i / LONG_BITS] |= 1UL << (i % LONG_BITS);
+		t->ndirty++;
+	}
+}
+
+/* The tiles an area covers, rounded outwards with room for
+ * antialiasing. Returns 0 if it is off the canvas */
+static int tile_span(const struct tiles *t, float x, float y, float w, float h,
+		     int *x0, int *y0, int *x1, int *y1)
+{
+	*x0 = max(0, floor(x) - 1) / TILE_SIZE;
+	*y0 = max(0, floor(y) - 1) / TILE_SIZE;
+	*x1 = min(t->nx - 1, (ceil(x + w) + 1) / TILE_SIZE);
+	*y1 = min(t->ny - 1, (ceil(y + h) + 1) / TILE_SIZE);
+
+	return *x0 <= *x1 && *y0 <= *y1;
+}
+
+/* Mark the tiles covering the given area dirty. Nothing is copied to
+ * the window until present() */
+static void damage(struct windata *win, float x, float y, float w, float h)
+{
+	int x0, y0, x1, y1, tx, ty;
+
+	if (!tile_span(&win->tiles, x, y, w, h, &x0, &y0, &x1, &y1))
+		return;
+
+	for (ty = y0; ty <= y1; ty++)
+		for (tx = x0; tx <= x1; tx++)
+			tile_damage(&win->tiles, tx, ty);
+}
+
+/* Damage for something drawn onto the canvas, as opposed to an area
+ * that only needs presenting again. The tiles it covers now differ
+ * from the background */
+static void draw_damage(struct windata *win, float x, float y, float w, float h)
+{
+	struct tiles *t = &win->tiles;
+	int x0, y0, x1, y1, tx, ty;
+	unsigned char *tile;
+
+	if (!tile_span(t, x, y, w, h, &x0, &y0, &x1, &y1))
+		return;
+
+	for (ty = y0; ty <= y1; ty++) {
+		for (tx = x0; tx <= x1; tx++) {
+			tile_damage(t, tx, ty);
+			tile = &t->occupied[ty * t->nx + tx];
+			if (!*tile) {
+				*tile = 1;
+				t->noccupied++;
+			}
+		}
+	}
+}
+
+/* The window lost the contents of an area and the server filled it
+ * with the background, only tiles holding more than that need to be
+ * presented again */
+static void damage_exposed(struct windata *win, int x, int y, int w, int h)
+{
+	struct tiles *t = &win->tiles;
+	float sx = 1, sy = 1;
+	int x0, y0, x1, y1, tx, ty;
+
+	/* window to canvas coordinates */
+	if (win->scaled) {
+		sx = (float)win->image.width / win->width;
+		sy = (float)win->image.height / win->height;
+	}
+
+	if (!t->noccupied ||
+	    !tile_span(t, x * sx, y * sy, w * sx, h * sy, &x0, &y0, &x1, &y1))
+		return;
+
+	for (ty = y0; ty <= y1; ty++)
+		for (tx = x0; tx <= x1; tx++)
+			if (t->occupied[ty * t->nx + tx])
+				tile_damage(t, tx, ty);
+}
+
+/* Turns the dirty bitmap into rectangles: a run of dirty tiles in a
+ * row is one rectangle, and grows downwards while the rows below have
+ * the same run. Returns the number of rectangles */
+static int tiles_to_rects(struct tiles *t, int width, int height)
+{
+	int nrects = 0, row_start;
+	int tx, ty, run, i;
+
+	for (ty = 0; ty < t->ny; ty++) {
+		row_start = nrects;
+		for (tx = 0; tx < t->nx; tx++) {
+			struct rect r;
+
+			if (!tile_dirty(t, tx, ty))
+				continue;
+			for (run = tx; tx < t->nx && tile_dirty(t, tx, ty); tx++)
+				;
+
+			r.x = run * TILE_SIZE;
+			r.y = ty * TILE_SIZE;
+			r.w = (tx - run) * TILE_SIZE;
+			r.h = TILE_SIZE;
+
+			/* only rectangles ending in the row above can grow */
+			for (i = 0; i < row_start; i++) {
+				if (t->rects[i].x == r.x && t->rects[i].w == r.w &&
+				    t->rects[i].y + t->rects[i].h == r.y) {
+					t->rects[i].h += TILE_SIZE;
+					break;
+				}
+			}
+			if (i == row_start)
+				t->rects[nrects++] = r;
+		}
+	}
+
+	/* the last row and column of tiles may stick out */
+	for (i = 0; i < nrects; i++) {
+		struct rect *r = &t->rects[i];
+
+		r->w = min(r->w, width - r->x);
+		r->h = min(r->h, height - r->y);
+		if (r->w <= 0 || r->h <= 0)
+			t->rects[i--] = t->rects[--nrects];
+	}
+
+	return nrects;
+}
+
+/* Hand all dirty tiles to the presenter in one go */
+static void present(struct windata *win)
+{
+	struct tiles *t = &win->tiles;
+	int nrects;
+
+	if (t->ndirty == 0)
+		return;
+
+	if (win->scaled)
+		nrects = tiles_to_rects(t, win->image.width, win->image.height);
+	else
+		nrects = tiles_to_rects(t, min(win->width, win->image.width),
+					min(win->height, win->image.height));
+	if (nrects)
+		win->presenter->present(win, t->rects, nrects);
+
+	memset(t->dirty, 0, NLONGS(t->nx * t->ny) * sizeof(*t->dirty));
+	t->ndirty = 0;
+}
+
 static void expose(struct windata *win, int x, int y, int w, int h)
 {
-	cairo_set_source_surface(win->cr_win, win->surface, 0, 0);
-	cairo_rectangle(win->cr_win, x, y, w, h);
-	cairo_fill(win->cr_win);
-	XFlush(win->dsp);
+	damage(win, x, y, w, h);
+	present(win);
 }
 
-static void clear_screen(struct touch_info *touch_info, struct windata *w)
+/* Back to the background, only where something was drawn */
+static void clear_screen(struct windata *w)
 {
-	int width = touch_info->maxx - touch_info->minx;
-	int height = touch_info->maxy - touch_info->miny;
+	struct tiles *t = &w->tiles;
+	int tx, ty;
 
-	cairo_set_line_width(w->cr, 1);
-	cairo_set_source_rgb(w->cr, 1, 1, 1);
-	cairo_rectangle(w->cr, 0, 0, width, height);
+	if (!t->noccupied)
+		return;
+
+	cairo_save(w->cr);
+	/* an A8 canvas is coverage only, white is where there is none */
+	if (w->format == CAIRO_FORMAT_A8)
+		cairo_set_operator(w->cr, CAIRO_OPERATOR_CLEAR);
+	else
+		cairo_set_source_rgb(w->cr, 1, 1, 1);
+	for (ty = 0; ty < t->ny; ty++) {
+		for (tx = 0; tx < t->nx; tx++) {
+			if (!t->occupied[ty * t->nx + tx])
+				continue;
+			cairo_rectangle(w->cr, tx * TILE_SIZE, ty * TILE_SIZE,
+					TILE_SIZE, TILE_SIZE);
+			tile_damage(t, tx, ty);
+			t->occupied[ty * t->nx + tx] = 0;
+		}
+	}
 	cairo_fill(w->cr);
+	cairo_restore(w->cr);
+	t->noccupied = 0;
 
-	expose(w, 0, 0, width, height);
+	present(w);
 }
 
-static void output_touch(const struct touch_info *touch_info,
-			 struct windata *w,
-			 const struct touch_data *t)
+/* Centre and extent of a contact in canvas coordinates */
+static void touch_geometry(const struct touch_info *touch_info,
+			   const struct view *v,
+			   const struct touch_data *t,
+			   float *px, float *py, float *pmx, float *pmy)
 {
-	float dx = 1.0 * w->width/(touch_info->maxx - touch_info->minx);
-	float dy = 1.0 * w->height/(touch_info->maxy - touch_info->miny);
-	float x = (t->data[ABS_MT_POSITION_X] - touch_info->minx) * dx,
-	      y = (t->data[ABS_MT_POSITION_Y] - touch_info->miny) * dy;
+	float dx = v->dx, dy = v->dy;
+	float x = v->x + (t->axes[AXIS_X] - touch_info->minx) * dx,
+	      y = v->y + (t->axes[AXIS_Y] - touch_info->miny) * dy;
 	float major = 0, minor = 0, angle = 0;
 
 	if (touch_info->has_pressure) {
-		major = DEFAULT_WIDTH_MULTIPLIER * t->data[ABS_MT_PRESSURE] * dy;
-		minor = DEFAULT_WIDTH_MULTIPLIER * t->data[ABS_MT_PRESSURE] * dx;
+		major = DEFAULT_WIDTH_MULTIPLIER * t->axes[AXIS_PRESSURE] * dy;
+		minor = DEFAULT_WIDTH_MULTIPLIER * t->axes[AXIS_PRESSURE] * dx;
 		angle = 0;
 	}
 
 	if (touch_info->has_touch_major) {
-		major = minor = t->data[ABS_MT_TOUCH_MAJOR];
+		major = minor = t->axes[AXIS_TOUCH_MAJOR];
 		if (touch_info->has_touch_minor)
-			minor = t->data[ABS_MT_TOUCH_MINOR];
-		angle = t->data[ABS_MT_ORIENTATION];
+			minor = t->axes[AXIS_TOUCH_MINOR];
+		angle = t->axes[AXIS_ORIENTATION];
 	}
 	if (major == 0 && minor == 0) {
 		major = DEFAULT_WIDTH;
@@ -196,227 +738,2507 @@ static void output_touch(const struct touch_info *touch_info,
 
 	float ac = fabs(cos(angle));
 	float as = fabs(sin(angle));
-	float mx = max(MIN_WIDTH, max(minor * ac, major * as) * dx);
-	float my = max(MIN_WIDTH, max(major * ac, minor * as) * dy);
 
-	if (w->id[t->data[ABS_MT_SLOT]] != t->data[ABS_MT_TRACKING_ID]) {
-		w->id[t->data[ABS_MT_SLOT]] = t->data[ABS_MT_TRACKING_ID];
-		w->color[t->data[ABS_MT_SLOT]] = new_color(w);
+	*px = x;
+	*py = y;
+	*pmx = max(MIN_WIDTH, max(minor * ac, major * as) * dx);
+	*pmy = max(MIN_WIDTH, max(major * ac, minor * as) * dy);
+}
+
+/* Remember where every active contact is now, without drawing
+ * anything. The positions are joined up on the next render */
+static void trail_add(const struct touch_info *touch_info,
+		      struct view *v)
+{
+	int i;
+
+	for (i = 0; i < touch_info->ntouches; i++) {
+		const struct touch_data *t = &touch_info->touches[i];
+		struct trail *trail = &v->slots[i].trail;
+		float x, y, mx, my;
+		int n;
+
+		if (!t->active) {
+			trail->npoints = 0;
+			continue;
+		}
+
+		if (trail->tracking_id != t->axes[AXIS_TRACKING_ID]) {
+			trail->tracking_id = t->axes[AXIS_TRACKING_ID];
+			trail->npoints = 0;
+		}
+
+		touch_geometry(touch_info, v, t, &x, &y, &mx, &my);
+
+		/* out of room, let the newest point replace the last */
+		n = min(trail->npoints, DIM_TRAIL - 1);
+		trail->x[n] = x;
+		trail->y[n] = y;
+		trail->width = min(mx, my);
+		trail->npoints = n + 1;
 	}
+}
+
+static void output_trail(struct windata *w, struct trail *trail)
+{
+	float x0, y0, x1, y1;
+	int i;
+
+	if (trail->npoints < 2)
+		return;
+
+	x0 = x1 = trail->x[0];
+	y0 = y1 = trail->y[0];
 
-	cairo_set_source_rgb(w->cr,
-			     w->color[t->data[ABS_MT_SLOT]].r,
-			     w->color[t->data[ABS_MT_SLOT]].g,
-			     w->color[t->data[ABS_MT_SLOT]].b);
-	/* cairo ellipsis */
 	cairo_save(w->cr);
-	cairo_translate(w->cr, x, y);
-	cairo_scale(w->cr, mx/2., my/2.);
-	cairo_arc(w->cr, 0, 0, 1, 0, 2 * M_PI);
-	cairo_fill(w->cr);
+	cairo_set_line_width(w->cr, trail->width);
+	cairo_set_line_cap(w->cr, CAIRO_LINE_CAP_ROUND);
+	cairo_move_to(w->cr, trail->x[0], trail->y[0]);
+	for (i = 1; i < trail->npoints; i++) {
+		cairo_line_to(w->cr, trail->x[i], trail->y[i]);
+		x0 = min(x0, trail->x[i]);
+		y0 = min(y0, trail->y[i]);
+		x1 = max(x1, trail->x[i]);
+		y1 = max(y1, trail->y[i]);
+	}
+	cairo_stroke(w->cr);
 	cairo_restore(w->cr);
 
-	expose(w, x - mx/2, y - my/2, mx, my);
+	draw_damage(w, x0 - trail->width/2, y0 - trail->width/2,
+	       x1 - x0 + trail->width, y1 - y0 + trail->width);
+
+	/* next segment starts where this one ended */
+	trail->x[0] = trail->x[trail->npoints - 1];
+	trail->y[0] = trail->y[trail->npoints - 1];
+	trail->npoints = 1;
+}
+
+static void output_touch(const struct touch_info *touch_info,
+			 struct windata *w, struct view *v,
+			 const struct touch_data *t)
+{
+	struct slot *slot = &v->slots[t - touch_info->touches];
+	float x, y, mx, my;
+
+	touch_geometry(touch_info, v, t, &x, &y, &mx, &my);
+
+	if (slot->tracking_id != t->axes[AXIS_TRACKING_ID]) {
+		slot->tracking_id = t->axes[AXIS_TRACKING_ID];
+		slot->color = new_color(w);
+		slot->pixel = 0xff000000 |
+			      (uint32_t)(slot->color.r * 255) << 16 |
+			      (uint32_t)(slot->color.g * 255) << 8 |
+			      (uint32_t)(slot->color.b * 255);
+	}
+
+	cairo_set_source_rgb(w->cr, slot->color.r, slot->color.g, slot->color.b);
+
+	if (w->opts->trails)
+		output_trail(w, &slot->trail);
+
+	if (w->sprites) {
+		cairo_surface_flush(w->surface);
+		sprite_cache_draw(w->sprites, &w->image, x, y, mx, my,
+				  slot->pixel);
+		cairo_surface_mark_dirty(w->surface);
+	} else if (w->raster) {
+		/* anything cairo still has queued goes in first */
+		cairo_surface_flush(w->surface);
+		raster_fill_ellipse(w->raster, &w->image, x, y, mx/2., my/2.,
+				    slot->pixel);
+		cairo_surface_mark_dirty(w->surface);
+	} else {
+		/* cairo ellipsis */
+		cairo_save(w->cr);
+		cairo_translate(w->cr, x, y);
+		cairo_scale(w->cr, mx/2., my/2.);
+		cairo_arc(w->cr, 0, 0, 1, 0, 2 * M_PI);
+		cairo_fill(w->cr);
+		cairo_restore(w->cr);
+	}
+
+	/* sprites are placed on whole pixels and rounded up in size */
+	if (w->sprites)
+		draw_damage(w, x - mx/2 - 1, y - my/2 - 1, mx + 2, my + 2);
+	else
+		draw_damage(w, x - mx/2, y - my/2, mx, my);
 }
 
-static void report_frame(const struct touch_info *touch_info,
-			 struct windata *w)
+static uint64_t now_ns(void)
 {
-	int i;
+	struct timespec ts;
 
-	for (i = 0; i < touch_info->ntouches; i++)
-		if (touch_info->touches[i].active)
-			output_touch(touch_info, w, &touch_info->touches[i]);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static int init_window(struct windata *w)
+static void record_latency(struct windata *w, const struct frame_times *t,
+			   uint64_t start, uint64_t drawn, uint64_t presented)
+{
+	struct histogram *h = w->latency;
+	uint64_t first = t->kernel ? t->kernel : t->read;
+
+	if (t->kernel && t->read >= t->kernel)
+		histogram_add(&h[LAT_KERNEL], t->read - t->kernel);
+	if (t->read && t->decoded >= t->read)
+		histogram_add(&h[LAT_DECODE], t->decoded - t->read);
+	if (t->decoded && start >= t->decoded)
+		histogram_add(&h[LAT_QUEUE], start - t->decoded);
+	histogram_add(&h[LAT_DRAW], drawn - start);
+	histogram_add(&h[LAT_PRESENT], presented - drawn);
+	if (first && presented >= first)
+		histogram_add(&h[LAT_TOTAL], presented - first);
+}
+
+static void print_latency(struct windata *w)
 {
-	int event, err;
 	int i;
 
-	memset(w, 0, sizeof(*w));
-	for (i = 0; i < DIM_TOUCH; i++)
-		w->id[i] = -1;
+	if (!w->latency)
+		return;
 
-	w->dsp = XOpenDisplay(NULL);
-	if (!w->dsp)
+	for (i = 0; i < NLAT; i++)
+		histogram_print(stdout, latency_names[i], &w->latency[i],
+				1000.0, "us");
+	fflush(stdout);
+}
+
+/* SIGUSR1 prints the latency so far. Blocked here so threads started
+ * afterwards inherit the mask and it is only seen through the fd */
+static int latency_signal_init(struct windata *w)
+{
+	sigset_t mask;
+
+	if (!w->latency)
 		return -1;
-	if (!XQueryExtension(w->dsp, "XInputExtension", &opcode, &event, &err))
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
 		return -1;
 
-	w->screen = DefaultScreen(w->dsp);
-	w->white = WhitePixel(w->dsp, w->screen);
-	w->black = BlackPixel(w->dsp, w->screen);
+	return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
 
-	w->width = DisplayWidth(w->dsp, w->screen);
-	w->height = DisplayHeight(w->dsp, w->screen);
-	w->off_x = 0;
-	w->off_y = 0;
-	w->win = XCreateSimpleWindow(w->dsp, XDefaultRootWindow(w->dsp),
-				     0, 0, w->width, w->height,
-				     0, w->black, w->white);
-	w->gc = DefaultGC(w->dsp, w->screen);
-	w->visual = DefaultVisual(w->dsp, w->screen);
+static void latency_signalled(int fd, struct windata *w)
+{
+	struct signalfd_siginfo si;
 
+	while (read(fd, &si, sizeof(si)) == sizeof(si))
+		;
+	print_latency(w);
+}
 
-	w->surface_win = cairo_xlib_surface_create(w->dsp, w->win, w->visual,
-						   w->width, w->height);
-	w->cr_win = cairo_create(w->surface_win);
+/* Redraws the statistics box in the top left corner of the view if
+ * the input thread published a new summary since it was last drawn */
+static void draw_overlay(struct windata *w, const struct view *v)
+{
+	struct stats_overlay *o = v->overlay;
+	struct stats_summary sum;
+	cairo_text_extents_t ext;
+	char lines[5][128];
+	double width = 0, height;
+	int i, n = 0, len;
+
+	if (!o || !atomic_load_explicit(&o->updated, memory_order_acquire))
+		return;
 
-	w->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-						w->width, w->height);
-	w->cr = cairo_create(w->surface);
+	pthread_mutex_lock(&o->lock);
+	sum = o->summary;
+	atomic_store_explicit(&o->updated, 0, memory_order_relaxed);
+	pthread_mutex_unlock(&o->lock);
+
+	snprintf(lines[n++], sizeof(lines[0]), "%llu reports, %.1f Hz",
+		 (unsigned long long)sum.nreports, sum.rate);
+	snprintf(lines[n++], sizeof(lines[0]),
+		 "interval %.2f ms, sd %.3f", sum.interval_mean / 1e6,
+		 sum.interval_stddev / 1e6);
+	snprintf(lines[n++], sizeof(lines[0]),
+		 "p50 %.2f p99 %.2f max %.2f ms", sum.interval_p50 / 1e6,
+		 sum.interval_p99 / 1e6, sum.interval_max / 1e6);
+	snprintf(lines[n++], sizeof(lines[0]), "contacts %.2f avg, %d max",
+		 sum.contacts_mean, sum.contacts_max);
+	len = snprintf(lines[n], sizeof(lines[0]), "slot Hz");
+	for (i = 0; i < sum.nslots && len < (int)sizeof(lines[0]) - 8; i++)
+		len += snprintf(lines[n] + len, sizeof(lines[0]) - len,
+				" %.0f", sum.slot_rate[i]);
+	n++;
 
-	cairo_set_line_width(w->cr, 1);
-	cairo_set_source_rgb(w->cr, 1, 1, 1);
-	cairo_rectangle(w->cr, 0, 0, w->width, w->height);
+	cairo_save(w->cr);
+	cairo_set_font_size(w->cr, 12);
+	for (i = 0; i < n; i++) {
+		cairo_text_extents(w->cr, lines[i], &ext);
+		width = max(width, ext.x_advance);
+	}
+	width += 8;
+	height = n * 14 + 6;
+
+	if (w->format == CAIRO_FORMAT_A8)
+		cairo_set_operator(w->cr, CAIRO_OPERATOR_CLEAR);
+	else
+		cairo_set_source_rgb(w->cr, 1, 1, 1);
+	cairo_rectangle(w->cr, v->x, v->y, width, height);
 	cairo_fill(w->cr);
 
-	expose(w, 0, 0, w->width, w->height);
-
-	XSelectInput(w->dsp, w->win, StructureNotifyMask|ExposureMask);
-	XMapWindow(w->dsp, w->win);
-	XFlush(w->dsp);
+	cairo_set_operator(w->cr, CAIRO_OPERATOR_OVER);
+	cairo_set_source_rgb(w->cr, 0, 0, 0);
+	for (i = 0; i < n; i++) {
+		cairo_move_to(w->cr, v->x + 4, v->y + 15 + i * 14);
+		cairo_show_text(w->cr, lines[i]);
+	}
+	cairo_restore(w->cr);
 
-	return 0;
+	draw_damage(w, v->x, v->y, width, height);
 }
 
-static void term_window(struct windata *w)
+/* Draws the contacts of every view that changed since the last call.
+ * Nothing is ever erased, a contact that stayed put is already on the
+ * canvas */
+static void report_frame(struct windata *w)
 {
-	cairo_destroy(w->cr);
-	cairo_destroy(w->cr_win);
-	cairo_surface_destroy(w->surface);
-	cairo_surface_destroy(w->surface_win);
+	uint64_t start, drawn, presented;
+	int i, j;
 
-	XDestroyWindow(w->dsp, w->win);
-	XCloseDisplay(w->dsp);
-}
+	start = now_ns();
 
-static void set_screen_size_mtdev(struct windata *w,
-				  XEvent *xev)
-{
-	XConfigureEvent *cev = (XConfigureEvent *)xev;
+	for (j = 0; j < w->nviews; j++) {
+		struct view *v = &w->views[j];
+		struct touch_info *touch_info = &v->frame.touch_info;
 
-	if (cev && cev->width && cev->height) {
-		if (cev->width != w->width || cev->height != w->height)
-		{
-			cairo_destroy(w->cr_win);
-			cairo_surface_destroy(w->surface_win);
+		for (i = 0; i < touch_info->ntouches; i++) {
+			struct touch_data *t = &touch_info->touches[i];
 
-			w->width = cev->width;
-			w->height = cev->height;
-			w->surface_win = cairo_xlib_surface_create(w->dsp, w->win,
-								   w->visual,
-								   w->width, w->height);
-			w->cr_win = cairo_create(w->surface_win);
-			expose(w, 0, 0, w->width, w->height);
+			if (t->active && t->dirty)
+				output_touch(touch_info, w, v, t);
+			t->dirty = 0;
 		}
+
+		draw_overlay(w, v);
+	}
+
+	drawn = now_ns();
+	present(w);
+	presented = now_ns();
+
+	w->nframes++;
+	w->draw_ns += drawn - start;
+	w->present_ns += presented - drawn;
+
+	for (j = 0; j < w->nviews; j++) {
+		struct view *v = &w->views[j];
+
+		if (w->latency && v->fresh)
+			record_latency(w, &v->frame.times,
+				       start, drawn, presented);
+		v->fresh = 0;
 	}
 }
 
-static void handle_key_event(struct input_event *ev, struct touch_info *touch_info)
+static int pacer_init(struct pacer *p, int rate)
 {
-	int slot;
+	memset(p, 0, sizeof(*p));
+	p->fd = -1;
 
-	if (touch_info->has_mt)
-		return;
+	if (rate <= 0)
+		return 0;
 
-	slot = touch_info->current_slot;
+	p->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+	if (p->fd < 0)
+		return -1;
+	p->period = 1000000000 / rate;
 
-	/* Switch of tool is new tracking ID, so we get a new-coloured
-	   circle. Exception is BTN_TOUCH, since that just indicates current
-	   tool touched surface */
-	if (ev->code >= BTN_DIGI && ev->code < BTN_WHEEL && ev->code != BTN_TOUCH)
-		touch_info->touches[slot].data[ABS_MT_TRACKING_ID] = ev->code;
+	return 0;
 }
 
-static void handle_abs_event(struct input_event *ev, struct touch_info *touch_info)
+static void pacer_destroy(struct pacer *p)
 {
-	int slot;
+	if (p->fd >= 0)
+		close(p->fd);
+}
+
+/* New input arrived. Returns 1 if it should be rendered right away,
+ * otherwise the timer is armed for the end of the current refresh
+ * period. Nothing is armed while there is no input */
+static int pacer_schedule(struct pacer *p)
+{
+	struct itimerspec its;
+	uint64_t next;
+
+	if (p->fd < 0)
+		return 1;
+
+	p->pending = 1;
+	if (p->armed)
+		return 0;
+
+	memset(&its, 0, sizeof(its));
+	next = p->last + p->period;
+	if (next <= now_ns())
+		return 1;
+
+	its.it_value.tv_sec = next / 1000000000;
+	its.it_value.tv_nsec = next % 1000000000;
+	timerfd_settime(p->fd, TFD_TIMER_ABSTIME, &its, NULL);
+	p->armed = 1;
+
+	return 0;
+}
+
+/* The timer fired. Returns 1 if there is anything to render */
+static int pacer_expired(struct pacer *p)
+{
+	uint64_t expirations;
+
+	if (read(p->fd, &expirations, sizeof(expirations)) < 0)
+		return 0;
+	p->armed = 0;
+
+	return p->pending;
+}
+
+static void pacer_rendered(struct pacer *p)
+{
+	p->last = now_ns();
+	p->pending = 0;
+}
+
+static int fade_init(struct fade *f, struct windata *w,
+		     int ms, int rate)
+{
+	memset(f, 0, sizeof(*f));
+	f->fd = -1;
+
+	if (ms <= 0)
+		return 0;
+
+	w->fader = w->raster ? w->raster : raster_find("auto");
+
+	f->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+	if (f->fd < 0)
+		return -1;
+	f->period = 1000000000 / (rate > 0 ? rate : FADE_RATE);
+	f->duration = (uint64_t)ms * 1000000;
+
+	return 0;
+}
+
+static void fade_destroy(struct fade *f)
+{
+	if (f->fd >= 0)
+		close(f->fd);
+}
+
+/* Runs the timer while there is something to fade, stops it once the
+ * canvas is back to the background */
+static void fade_schedule(struct fade *f, struct windata *w)
+{
+	struct itimerspec its;
+
+	if (f->fd < 0 || f->armed == (w->tiles.noccupied != 0))
+		return;
+
+	memset(&its, 0, sizeof(its));
+	if (w->tiles.noccupied) {
+		its.it_value.tv_sec = f->period / 1000000000;
+		its.it_value.tv_nsec = f->period % 1000000000;
+		its.it_interval = its.it_value;
+		f->last = now_ns();
+		f->owed = 0;
+	}
+	timerfd_settime(f->fd, 0, &its, NULL);
+	f->armed = (w->tiles.noccupied != 0);
+}
+
+/* The timer fired, fade every occupied tile by the time that passed.
+ * A channel loses a level every duration / 255, whatever the timer
+ * rate, so a fully saturated pixel is white after the fade time. Time
+ * that doesn't make up a whole level is carried to the next step */
+static void fade_expired(struct fade *f, struct windata *w)
+{
+	struct tiles *t = &w->tiles;
+	uint64_t expirations, now;
+	unsigned int levels;
+	int tx, ty, x, y, i, j, touching = 0;
+	unsigned char *tile;
+
+	if (read(f->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	now = now_ns();
+	f->owed += (now - f->last) * 255;
+	f->last = now;
+	levels = f->owed / f->duration;
+	f->owed %= f->duration;
+	if (!levels)
+		return;
+	if (levels > 255)
+		levels = 255;
+
+	cairo_surface_flush(w->surface);
+	for (ty = 0; ty < t->ny; ty++) {
+		for (tx = 0; tx < t->nx; tx++) {
+			tile = &t->occupied[ty * t->nx + tx];
+			if (!*tile)
+				continue;
+
+			x = tx * TILE_SIZE;
+			y = ty * TILE_SIZE;
+			if (!raster_fade(w->fader, &w->image, x, y,
+					 min(TILE_SIZE, w->image.width - x),
+					 min(TILE_SIZE, w->image.height - y),
+					 levels)) {
+				*tile = 0;
+				t->noccupied--;
+			}
+			tile_damage(t, tx, ty);
+		}
+	}
+	cairo_surface_mark_dirty(w->surface);
+
+	/* only what's left behind fades, contacts still down are
+	 * painted back at full strength */
+	for (j = 0; j < w->nviews; j++) {
+		struct touch_info *ti = &w->views[j].frame.touch_info;
+
+		for (i = 0; i < ti->ntouches; i++) {
+			if (ti->touches[i].active) {
+				ti->touches[i].dirty = 1;
+				touching = 1;
+			}
+		}
+	}
+
+	if (touching)
+		report_frame(w);
+	else
+		present(w);
+	fade_schedule(f, w);
+}
+
+/* Copies the contact state into dst's own touches array */
+static void touch_info_copy(struct touch_info *dst,
+			    const struct touch_info *src)
+{
+	struct touch_data *touches = dst->touches;
+
+	*dst = *src;
+	dst->touches = touches;
+	memcpy(touches, src->touches, src->ntouches * sizeof(*touches));
+}
+
+/* Like touch_info_copy(), but contacts that were dirty in dst stay
+ * dirty. Used where dst is replaced before it was drawn */
+static void touch_info_replace(struct touch_info *dst,
+			       const struct touch_info *src)
+{
+	struct touch_data *touches = dst->touches;
+	int i, dirty;
+
+	*dst = *src;
+	dst->touches = touches;
+	for (i = 0; i < src->ntouches; i++) {
+		dirty = touches[i].dirty;
+		touches[i] = src->touches[i];
+		touches[i].dirty |= dirty;
+	}
+}
+
+/* One view per device, each starting out with the device's current
+ * state. Called before init_canvas(), which sizes the canvas to fit
+ * them */
+static int init_views(struct windata *w, int nviews,
+		      struct touch_info *const *touch_info)
+{
+	int i, j;
+
+	w->views = calloc(nviews, sizeof(*w->views));
+	if (!w->views)
+		return -1;
+	w->nviews = nviews;
+
+	for (j = 0; j < nviews; j++) {
+		struct view *v = &w->views[j];
+		const struct touch_info *ti = touch_info[j];
+
+		v->frame.touch_info.touches = calloc(ti->ntouches,
+						     sizeof(struct touch_data));
+		v->nslots = ti->ntouches;
+		v->slots = calloc(v->nslots, sizeof(*v->slots));
+		if (!v->frame.touch_info.touches || !v->slots)
+			return -1;
+		touch_info_copy(&v->frame.touch_info, ti);
+
+		for (i = 0; i < v->nslots; i++) {
+			v->slots[i].tracking_id = -1;
+			v->slots[i].trail.tracking_id = -1;
+		}
+
+		v->range_x = max(1, ti->maxx - ti->minx);
+		v->range_y = max(1, ti->maxy - ti->miny);
+	}
+
+	return 0;
+}
+
+/* Where each view goes and its canvas pixels per device unit. A
+ * screen-sized canvas follows the window size, a device-sized one is
+ * scaled when presenting instead */
+static void update_scale(struct windata *w)
+{
+	int width = w->scaled ? w->image.width : w->width;
+	int height = w->scaled ? w->image.height : w->height;
+	int tiled = w->opts->layout == LAYOUT_TILED;
+	float column = (float)width / (tiled ? w->nviews : 1);
+	int i;
+
+	for (i = 0; i < w->nviews; i++) {
+		struct view *v = &w->views[i];
+
+		v->x = tiled ? i * column : 0;
+		v->y = 0;
+		v->dx = column / v->range_x;
+		v->dy = (float)height / v->range_y;
+	}
+}
+
+static void x11_present(struct windata *w,
+			const struct rect *rects, int nrects)
+{
+	int i;
+
+	cairo_save(w->cr_win);
+	if (w->scaled)
+		cairo_scale(w->cr_win,
+			    (double)w->width / w->image.width,
+			    (double)w->height / w->image.height);
+
+	for (i = 0; i < nrects; i++)
+		cairo_rectangle(w->cr_win,
+				rects[i].x, rects[i].y,
+				rects[i].w, rects[i].h);
+
+	if (w->format == CAIRO_FORMAT_A8) {
+		cairo_clip(w->cr_win);
+		cairo_set_source_rgb(w->cr_win, 1, 1, 1);
+		cairo_paint(w->cr_win);
+		cairo_set_source_rgb(w->cr_win, 0, 0, 0);
+		cairo_mask_surface(w->cr_win, w->surface, 0, 0);
+	} else {
+		cairo_set_source_surface(w->cr_win, w->surface, 0, 0);
+		cairo_fill(w->cr_win);
+	}
+
+	cairo_restore(w->cr_win);
+	/* with --latency, presented means the server has processed it */
+	if (w->latency)
+		XSync(w->dsp, False);
+	else
+		XFlush(w->dsp);
+}
+
+static void set_screen_size_mtdev(struct windata *w,
+				  XEvent *xev)
+{
+	XConfigureEvent *cev = (XConfigureEvent *)xev;
+
+	if (cev && cev->width && cev->height) {
+		if (cev->width != w->width || cev->height != w->height)
+		{
+			cairo_destroy(w->cr_win);
+			cairo_surface_destroy(w->surface_win);
+
+			w->width = cev->width;
+			w->height = cev->height;
+			w->surface_win = cairo_xlib_surface_create(w->dsp, w->win,
+								   w->visual,
+								   w->width, w->height);
+			w->cr_win = cairo_create(w->surface_win);
+			update_scale(w);
+			/* the Expose events that follow redraw it */
+		}
+	}
+}
+
+static int x11_get_fd(struct windata *w)
+{
+	return ConnectionNumber(w->dsp);
+}
+
+static void x11_dispatch(struct windata *w)
+{
+	XEvent xev;
+
+	while (XPending(w->dsp)) {
+		XNextEvent(w->dsp, &xev);
+		if (xev.type == ConfigureNotify)
+			set_screen_size_mtdev(w, &xev);
+		else if (xev.type == Expose)
+			damage_exposed(w, xev.xexpose.x, xev.xexpose.y,
+				       xev.xexpose.width, xev.xexpose.height);
+	}
+}
+
+static int x11_init(struct windata *w)
+{
+	int event, err;
+
+	w->dsp = XOpenDisplay(NULL);
+	if (!w->dsp)
+		return -1;
+	if (!XQueryExtension(w->dsp, "XInputExtension", &opcode, &event, &err))
+		return -1;
+
+	w->screen = DefaultScreen(w->dsp);
+	w->white = WhitePixel(w->dsp, w->screen);
+	w->black = BlackPixel(w->dsp, w->screen);
+
+	w->width = DisplayWidth(w->dsp, w->screen);
+	w->height = DisplayHeight(w->dsp, w->screen);
+	w->off_x = 0;
+	w->off_y = 0;
+	w->win = XCreateSimpleWindow(w->dsp, XDefaultRootWindow(w->dsp),
+				     0, 0, w->width, w->height,
+				     0, w->black, w->white);
+	w->gc = DefaultGC(w->dsp, w->screen);
+	w->visual = DefaultVisual(w->dsp, w->screen);
+
+
+	w->surface_win = cairo_xlib_surface_create(w->dsp, w->win, w->visual,
+						   w->width, w->height);
+	w->cr_win = cairo_create(w->surface_win);
+
+	XSelectInput(w->dsp, w->win, StructureNotifyMask|ExposureMask);
+	XMapWindow(w->dsp, w->win);
+	XFlush(w->dsp);
+
+	return 0;
+}
+
+static void x11_term(struct windata *w)
+{
+	cairo_destroy(w->cr_win);
+	cairo_surface_destroy(w->surface_win);
+
+	XDestroyWindow(w->dsp, w->win);
+	XCloseDisplay(w->dsp);
+}
+
+static const struct presenter x11_presenter = {
+	.name = "x11",
+	.init = x11_init,
+	.present = x11_present,
+	.get_fd = x11_get_fd,
+	.dispatch = x11_dispatch,
+	.term = x11_term,
+};
+
+/* Errors from XShmAttach() arrive asynchronously, e.g. when the server
+ * is on another machine. Caught here during the XSync() after it */
+static int shm_failed;
+
+static int shm_error_handler(Display *dpy, XErrorEvent *ev)
+{
+	shm_failed = 1;
+	return 0;
+}
+
+/* The canvas has to be usable as ARGB32 by cairo and as a ZPixmap of
+ * the window's visual by the server, without conversion */
+static int x11_shm_attach(struct windata *w)
+{
+	int (*handler)(Display *, XErrorEvent *);
+	int depth = DefaultDepth(w->dsp, w->screen);
+	XImage *image;
+
+	if (!XShmQueryExtension(w->dsp) ||
+	    (depth != 24 && depth != 32) ||
+	    w->visual->red_mask != 0xff0000 ||
+	    w->visual->green_mask != 0x00ff00 ||
+	    w->visual->blue_mask != 0x0000ff)
+		return -1;
+
+	image = XShmCreateImage(w->dsp, w->visual, depth, ZPixmap, NULL,
+				&w->shm, w->width, w->height);
+	if (!image)
+		return -1;
+	if (image->bits_per_pixel != 32 ||
+	    image->byte_order != ImageByteOrder(w->dsp) ||
+	    (image->byte_order == LSBFirst) != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)) {
+		XDestroyImage(image);
+		return -1;
+	}
+
+	w->shm.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height,
+			      IPC_CREAT | 0600);
+	if (w->shm.shmid < 0) {
+		XDestroyImage(image);
+		return -1;
+	}
+	w->shm.shmaddr = image->data = shmat(w->shm.shmid, NULL, 0);
+	w->shm.readOnly = True;
+
+	shm_failed = 0;
+	if (w->shm.shmaddr != (void *)-1) {
+		handler = XSetErrorHandler(shm_error_handler);
+		XShmAttach(w->dsp, &w->shm);
+		XSync(w->dsp, False);
+		XSetErrorHandler(handler);
+	}
+
+	/* gone as soon as both sides detach */
+	shmctl(w->shm.shmid, IPC_RMID, NULL);
+
+	if (w->shm.shmaddr == (void *)-1 || shm_failed) {
+		if (w->shm.shmaddr != (void *)-1)
+			shmdt(w->shm.shmaddr);
+		image->data = NULL;
+		XDestroyImage(image);
+		return -1;
+	}
+
+	w->shm_image = image;
+
+	return 0;
+}
+
+static void x11_shm_present(struct windata *w,
+			    const struct rect *rects, int nrects)
+{
+	int i;
+
+	cairo_surface_flush(w->surface);
+	for (i = 0; i < nrects; i++)
+		XShmPutImage(w->dsp, w->win, w->gc, w->shm_image,
+			     rects[i].x, rects[i].y, rects[i].x, rects[i].y,
+			     rects[i].w, rects[i].h, False);
+	/* the server reads the segment while processing the requests, it
+	 * must be done before anything is drawn into it again */
+	XSync(w->dsp, False);
+}
+
+/* Falls back to the plain x11 presenter if the server can't share
+ * memory with us */
+static int x11_shm_init(struct windata *w)
+{
+	if (x11_init(w))
+		return -1;
+
+	if (x11_shm_attach(w)) {
+		msg("MIT-SHM is not available, copying frames to the server\n");
+		w->presenter = &x11_presenter;
+	}
+
+	return 0;
+}
+
+static cairo_surface_t *x11_shm_create_surface(struct windata *w)
+{
+	return cairo_image_surface_create_for_data((unsigned char *)w->shm_image->data,
+						   CAIRO_FORMAT_ARGB32,
+						   w->width, w->height,
+						   w->shm_image->bytes_per_line);
+}
+
+static void x11_shm_term(struct windata *w)
+{
+	XShmDetach(w->dsp, &w->shm);
+	XSync(w->dsp, False);
+	shmdt(w->shm.shmaddr);
+	w->shm_image->data = NULL;
+	XDestroyImage(w->shm_image);
+
+	x11_term(w);
+}
+
+static const struct presenter x11_shm_presenter = {
+	.name = "x11-shm",
+	.init = x11_shm_init,
+	.present = x11_shm_present,
+	.get_fd = x11_get_fd,
+	.dispatch = x11_dispatch,
+	.term = x11_shm_term,
+	.create_surface = x11_shm_create_surface,
+};
+
+/* Raw dumps are a sequence of records, one per present:
+ *   u32 magic "MTVF", u32 sequence, u32 width, u32 height, u32 nrects
+ * followed by nrects times
+ *   i32 x, y, w, h, then h rows of w native-endian ARGB32 pixels */
+#define RAW_DUMP_MAGIC 0x4656544d
+
+static void headless_dump_raw(struct windata *w,
+			      const struct rect *rects, int nrects)
+{
+	unsigned char *data = cairo_image_surface_get_data(w->surface);
+	int stride = cairo_image_surface_get_stride(w->surface);
+	uint32_t header[5] = { RAW_DUMP_MAGIC, w->dump_seq,
+			       w->image.width, w->image.height, nrects };
+	int i, y;
+
+	fwrite(header, sizeof(header), 1, w->dump);
+	for (i = 0; i < nrects; i++) {
+		const struct rect *r = &rects[i];
+		int32_t geometry[4] = { r->x, r->y, r->w, r->h };
+
+		fwrite(geometry, sizeof(geometry), 1, w->dump);
+		for (y = r->y; y < r->y + r->h; y++)
+			fwrite(data + y * stride + r->x * 4, 4, r->w, w->dump);
+	}
+}
+
+static void headless_present(struct windata *w,
+			     const struct rect *rects, int nrects)
+{
+	char path[PATH_MAX];
+
+	if (!w->opts->dump)
+		return;
+
+	cairo_surface_flush(w->surface);
+
+	if (w->opts->dump_format == DUMP_RAW) {
+		headless_dump_raw(w, rects, nrects);
+	} else {
+		snprintf(path, sizeof(path), "%s/frame-%06u.png",
+			 w->opts->dump, w->dump_seq);
+		if (cairo_surface_write_to_png(w->surface, path) != CAIRO_STATUS_SUCCESS)
+			error("Failed to write %s\n", path);
+	}
+
+	w->dump_seq++;
+}
+
+static int headless_init(struct windata *w)
+{
+	char path[PATH_MAX];
+
+	w->width = w->opts->width;
+	w->height = w->opts->height;
+
+	if (w->opts->dump && w->opts->dump_format == DUMP_RAW) {
+		snprintf(path, sizeof(path), "%s/frames.raw", w->opts->dump);
+		w->dump = fopen(path, "we");
+		if (!w->dump) {
+			error("Failed to open %s (%s)\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void headless_term(struct windata *w)
+{
+	if (w->dump)
+		fclose(w->dump);
+}
+
+static const struct presenter headless_presenter = {
+	.name = "headless",
+	.init = headless_init,
+	.present = headless_present,
+	.term = headless_term,
+};
+
+static int init_window(struct windata *w, const struct options *opts)
+{
+	memset(w, 0, sizeof(*w));
+	w->opts = opts;
+	if (opts->latency) {
+		w->latency = calloc(NLAT, sizeof(*w->latency));
+		if (!w->latency)
+			return -1;
+	}
+
+	/* only a canvas the window can show as is can be shared */
+	if (opts->headless)
+		w->presenter = &headless_presenter;
+	else if (opts->no_shm || opts->canvas_scale > 0 ||
+		 opts->canvas_format != CAIRO_FORMAT_ARGB32)
+		w->presenter = &x11_presenter;
+	else
+		w->presenter = &x11_shm_presenter;
+
+	return w->presenter->init(w);
+}
+
+/* The buffer contacts are drawn into, once the views and so the
+ * device ranges are known */
+static int init_canvas(struct windata *w)
+{
+	const struct options *opts = w->opts;
+	int width = w->width, height = w->height;
+	float scale = opts->canvas_scale;
+	int range_x = 0, range_y = 0;
+	int i;
+
+	w->format = opts->canvas_format;
+
+	if (scale > 0) {
+		/* every column as wide as the widest device */
+		for (i = 0; i < w->nviews; i++) {
+			range_x = max(range_x, w->views[i].range_x);
+			range_y = max(range_y, w->views[i].range_y);
+		}
+		if (opts->layout == LAYOUT_TILED)
+			range_x *= w->nviews;
+
+		if (range_x * scale > CANVAS_MAX || range_y * scale > CANVAS_MAX) {
+			scale = min(CANVAS_MAX / (float)range_x,
+				    CANVAS_MAX / (float)range_y);
+			msg("Canvas limited to %d pixels, scale %.3f\n",
+			    CANVAS_MAX, scale);
+		}
+		width = max(1, range_x * scale);
+		height = max(1, range_y * scale);
+		w->scaled = 1;
+	}
+
+	if (w->format != CAIRO_FORMAT_ARGB32 &&
+	    ((opts->raster && strcmp(opts->raster, "cairo") != 0) ||
+	     opts->fade || (opts->dump && opts->dump_format == DUMP_RAW))) {
+		error("--raster, --fade and raw dumps need an argb32 canvas\n");
+		return -1;
+	}
+
+	if (w->presenter->create_surface)
+		w->surface = w->presenter->create_surface(w);
+	else
+		w->surface = cairo_image_surface_create(w->format,
+							width, height);
+	w->cr = cairo_create(w->surface);
+
+	w->image.data = cairo_image_surface_get_data(w->surface);
+	w->image.width = cairo_image_surface_get_width(w->surface);
+	w->image.height = cairo_image_surface_get_height(w->surface);
+	w->image.stride = cairo_image_surface_get_stride(w->surface);
+	if (tiles_init(&w->tiles, w->image.width, w->image.height))
+		return -1;
+
+	if (!opts->raster || strcmp(opts->raster, "cairo") == 0) {
+		/* the default */
+	} else if (strcmp(opts->raster, "sprite") == 0) {
+		w->sprites = sprite_cache_new(DIM_SPRITES);
+		if (!w->sprites)
+			return -1;
+	} else {
+		w->raster = raster_find(opts->raster);
+		if (!w->raster) {
+			error("Rasterizer %s is not available\n", opts->raster);
+			return -1;
+		}
+		msg("Drawing contacts with the %s rasterizer\n",
+		    w->raster->name);
+	}
+
+	update_scale(w);
+
+	/* an A8 canvas starts out clear, which is the background */
+	if (w->format != CAIRO_FORMAT_A8) {
+		cairo_set_line_width(w->cr, 1);
+		cairo_set_source_rgb(w->cr, 1, 1, 1);
+		cairo_rectangle(w->cr, 0, 0, width, height);
+		cairo_fill(w->cr);
+	}
+
+	expose(w, 0, 0, width, height);
+
+	return 0;
+}
+
+static void term_window(struct windata *w)
+{
+	int i;
+
+	if (w->nframes)
+		msg("%s: %u frames, %.1fus drawing and %.1fus presenting per frame\n",
+		    w->presenter->name, w->nframes,
+		    w->draw_ns / 1000.0 / w->nframes,
+		    w->present_ns / 1000.0 / w->nframes);
+
+	print_latency(w);
+	free(w->latency);
+
+	if (w->sprites) {
+		const struct sprite_stats *st = sprite_cache_stats(w->sprites);
+
+		msg("sprites: %lu hits, %lu misses, %lu evictions, %lu uncached\n",
+		    st->hits, st->misses, st->evictions, st->uncached);
+		sprite_cache_destroy(w->sprites);
+	}
+
+	for (i = 0; i < w->nviews; i++) {
+		free(w->views[i].slots);
+		free(w->views[i].frame.touch_info.touches);
+	}
+	free(w->views);
+	tiles_destroy(&w->tiles);
+
+	cairo_destroy(w->cr);
+	cairo_surface_destroy(w->surface);
+
+	if (w->presenter->term)
+		w->presenter->term(w);
+}
+
+/* Process whatever the presenter has queued, then show the result */
+static void dispatch_window(struct windata *w)
+{
+	if (w->presenter->dispatch)
+		w->presenter->dispatch(w);
+
+	present(w);
+}
+
+static int window_fd(struct windata *w)
+{
+	return w->presenter->get_fd ? w->presenter->get_fd(w) : -1;
+}
+
+/* Stores a value, marking the contact for redrawing if it changed */
+static inline void touch_set(struct touch_data *t, int axis, int value)
+{
+	if (t->axes[axis] != value) {
+		t->axes[axis] = value;
+		t->dirty = 1;
+	}
+}
+
+static void handle_key_event(struct input_event *ev, struct touch_info *touch_info)
+{
+	int slot;
+
+	if (touch_info->has_mt)
+		return;
+
+	slot = touch_info->current_slot;
+
+	/* Switch of tool is new tracking ID, so we get a new-coloured
+	   circle. Exception is BTN_TOUCH, since that just indicates current
+	   tool touched surface */
+	if (ev->code >= BTN_DIGI && ev->code < BTN_WHEEL && ev->code != BTN_TOUCH)
+		touch_set(&touch_info->touches[slot], AXIS_TRACKING_ID, ev->code);
+}
+
+static void handle_abs_event(struct input_event *ev, struct touch_info *touch_info)
+{
+	int slot, axis;
+
+	slot = touch_info->current_slot;
+	switch(ev->code) {
+		case ABS_MT_TRACKING_ID:
+			if (slot == -1)
+				break;
+			touch_info->touches[slot].active = (ev->value != -1);
+			break;
+		case ABS_MT_SLOT:
+			slot = ev->value;
+			if (ev->value >= touch_info->ntouches) {
+				msg("Too many simultaneous touches.\n");
+				slot = -1;
+			}
+			touch_info->current_slot = slot;
+			break;
+	}
+	if (slot == -1)
+		return;
+
+	axis = touch_info->axis_map[ev->code];
+	if (axis != -1)
+		touch_set(&touch_info->touches[slot], axis, ev->value);
+}
+
+static int handle_event(struct input_event *ev, struct touch_info *touch_info)
+{
+	if (ev->type == EV_SYN && ev->code == SYN_REPORT)
+		return 1;
+
+	if (ev->type == EV_ABS)
+		handle_abs_event(ev, touch_info);
+	if (ev->type == EV_KEY)
+		handle_key_event(ev, touch_info);
+
+	return 0;
+}
+
+static void frame_queue_destroy(struct frame_queue *q)
+{
+	if (q->wake_fd >= 0)
+		close(q->wake_fd);
+	if (q->space_fd >= 0)
+		close(q->space_fd);
+	if (q->stop_fd >= 0)
+		close(q->stop_fd);
+	free(q->touches);
+	free(q);
+}
+
+static struct frame_queue *frame_queue_new(int ntouches)
+{
+	struct frame_queue *q;
+	int i;
+
+	if (posix_memalign((void**)&q, 64, sizeof(*q)))
+		return NULL;
+	memset(q, 0, sizeof(*q));
+	q->wake_fd = q->space_fd = q->stop_fd = -1;
+
+	q->touches = calloc((DIM_FRAMES + 1) * ntouches, sizeof(*q->touches));
+	if (!q->touches) {
+		frame_queue_destroy(q);
+		return NULL;
+	}
+	for (i = 0; i < DIM_FRAMES; i++)
+		q->frames[i].touch_info.touches = &q->touches[i * ntouches];
+	q->pending.touch_info.touches = &q->touches[DIM_FRAMES * ntouches];
+
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	atomic_init(&q->sleeping, 0);
+	atomic_init(&q->stalled, 0);
+	atomic_init(&q->done, 0);
+	atomic_init(&q->stop, 0);
+
+	q->wake_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	q->space_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	q->stop_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (q->wake_fd < 0 || q->space_fd < 0 || q->stop_fd < 0) {
+		frame_queue_destroy(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+static void eventfd_drain(int fd)
+{
+	eventfd_t val;
+
+	eventfd_read(fd, &val);
+}
+
+/* Input thread: copy a frame into the ring if there is room. Returns 0
+ * on success, -1 if the ring is full */
+static int frame_queue_push(struct frame_queue *q,
+			    const struct touch_info *touch_info,
+			    const struct frame_times *times)
+{
+	struct frame *frame;
+	unsigned int head, tail;
+
+	head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	tail = atomic_load(&q->tail);
+	if (head - tail == DIM_FRAMES) {
+		atomic_store(&q->stalled, 1);
+		/* the render thread may have freed a slot before it could
+		 * see the flag, check again */
+		tail = atomic_load(&q->tail);
+		if (head - tail == DIM_FRAMES)
+			return -1;
+		atomic_store(&q->stalled, 0);
+	}
+
+	frame = &q->frames[head % DIM_FRAMES];
+	frame->times = *times;
+	touch_info_copy(&frame->touch_info, touch_info);
+	atomic_store(&q->head, head + 1);
+
+	if (atomic_exchange(&q->sleeping, 0))
+		eventfd_write(q->wake_fd, 1);
+
+	return 0;
+}
+
+/* Input thread: push the pending frame once there is room again */
+static void frame_queue_flush(struct frame_queue *q)
+{
+	if (q->has_pending &&
+	    frame_queue_push(q, &q->pending.touch_info, &q->pending.times) == 0)
+		q->has_pending = 0;
+}
+
+/* Input thread: hand a completed frame to the render thread. If the
+ * ring is full the frame waits in q->pending and replaces whatever
+ * was there, only the newest state is worth showing */
+static void frame_queue_publish(struct frame_queue *q,
+				const struct touch_info *touch_info,
+				const struct frame_times *times)
+{
+	q->nframes++;
+
+	if (!q->has_pending && frame_queue_push(q, touch_info, times) == 0)
+		return;
+
+	q->pending.times = *times;
+	if (q->has_pending)
+		touch_info_replace(&q->pending.touch_info, touch_info);
+	else
+		touch_info_copy(&q->pending.touch_info, touch_info);
+	q->has_pending = 1;
+	frame_queue_flush(q);
+}
+
+/* Render thread: returns the number of published frames. Frames
+ * begin to end - 1 stay valid until frame_queue_release() */
+static unsigned int frame_queue_peek(struct frame_queue *q,
+				     unsigned int *begin,
+				     unsigned int *end)
+{
+	*begin = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	*end = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	return *end - *begin;
+}
+
+static void frame_queue_release(struct frame_queue *q, unsigned int end)
+{
+	atomic_store(&q->tail, end);
+	q->nrendered++;
+
+	if (atomic_exchange(&q->stalled, 0))
+		eventfd_write(q->space_fd, 1);
+}
+
+/* Render thread: announce that we are about to sleep. Returns 0 if it's
+ * safe to do so, or -1 if a frame arrived in the meantime */
+static int frame_queue_prepare_wait(struct frame_queue *q)
+{
+	atomic_store(&q->sleeping, 1);
+	if (atomic_load(&q->head) != atomic_load_explicit(&q->tail, memory_order_relaxed) ||
+	    atomic_load(&q->done)) {
+		atomic_store(&q->sleeping, 0);
+		return -1;
+	}
+	return 0;
+}
+
+/* Feeds a completed frame, before its dirty flags are cleared, into
+ * the statistics */
+static void stats_frame(struct device *dev, const struct timeval *tv)
+{
+	struct touch_info *touch_info = &dev->touch_info;
+	struct stats_overlay *o = dev->overlay;
+	uint64_t time = (uint64_t)tv->tv_sec * 1000000000 + tv->tv_usec * 1000;
+	int i, ncontacts = 0;
+
+	for (i = 0; i < touch_info->ntouches; i++) {
+		struct touch_data *t = &touch_info->touches[i];
+
+		ncontacts += t->active;
+		if (t->dirty)
+			stats_slot(dev->stats, i, time, t->active, t->axes);
+	}
+	stats_report(dev->stats, time, ncontacts);
+
+	if (o && time - o->published >= STATS_PERIOD_NS) {
+		pthread_mutex_lock(&o->lock);
+		stats_summarize(dev->stats, &o->summary);
+		atomic_store_explicit(&o->updated, 1, memory_order_release);
+		pthread_mutex_unlock(&o->lock);
+		o->published = time;
+	}
+}
+
+/* Every slot, not just the dirty ones, so each frame in the ring
+ * stands on its own */
+static void publish_frame(struct device *dev, const struct timeval *tv)
+{
+	struct touch_info *touch_info = &dev->touch_info;
+	int i;
+
+	publisher_begin(dev->publisher, (uint64_t)tv->tv_sec * 1000000000 +
+				       tv->tv_usec * 1000);
+	for (i = 0; i < touch_info->ntouches; i++)
+		publisher_slot(dev->publisher, i, touch_info->touches[i].active,
+			       touch_info->touches[i].axes);
+	publisher_end(dev->publisher);
+}
+
+/* Run a batch of events through the decoder, handing each completed
+ * frame to the render thread. A trailing partial frame stays in
+ * touch_info until the rest of it arrives */
+static void process_events(struct device *dev,
+			   struct input_event *ev, int nevents)
+{
+	struct frame_times times;
+	int i, j;
+
+	if (dev->capture && capture_write(dev->capture, ev, nevents) != 0) {
+		error("Failed to write capture, recording stopped\n");
+		capture_close(dev->capture);
+		dev->capture = NULL;
+	}
+
+	for (i = 0; i < nevents; i++) {
+		if (!handle_event(&ev[i], &dev->touch_info))
+			continue;
+
+		if (dev->stats)
+			stats_frame(dev, &ev[i].time);
+		if (dev->publisher)
+			publish_frame(dev, &ev[i].time);
+
+		times.kernel = dev->monotonic ?
+			       (uint64_t)ev[i].time.tv_sec * 1000000000 +
+			       ev[i].time.tv_usec * 1000 : 0;
+		times.read = dev->read_ns;
+		times.decoded = now_ns();
+		frame_queue_publish(dev->queue, &dev->touch_info, &times);
+		/* the next frame only carries what changes after this one */
+		for (j = 0; j < dev->touch_info.ntouches; j++)
+			dev->touch_info.touches[j].dirty = 0;
+	}
+}
+
+/* Feed raw protocol A events through mtdev and decode the converted
+ * frames */
+static void convert_events_mtdev(struct device *dev,
+				 struct input_event *ev, int n)
+{
+	struct event_buffer *buf = &dev->buf;
+	int i;
+
+	buf->nevents = 0;
+	for (i = 0; i < n; i++) {
+		mtdev_put_event(dev->mtdev, &ev[i]);
+		if (ev[i].type != EV_SYN || ev[i].code != SYN_REPORT)
+			continue;
+
+		/* mtdev converts a whole frame on SYN_REPORT, pull
+		 * it out before its own queue fills up */
+		while (!mtdev_empty(dev->mtdev)) {
+			if (buf->nevents == ARRAY_SIZE(buf->events)) {
+				process_events(dev, buf->events, buf->nevents);
+				buf->nevents = 0;
+			}
+			mtdev_get_event(dev->mtdev, &buf->events[buf->nevents++]);
+		}
+	}
+
+	process_events(dev, buf->events, buf->nevents);
+}
+
+static void decode_events(struct device *dev,
+			  struct input_event *ev, int n)
+{
+	if (n <= 0)
+		return;
+
+	if (dev->mtdev)
+		convert_events_mtdev(dev, ev, n);
+	else
+		process_events(dev, ev, n);
+}
+
+static void set_event(struct input_event *ev, const struct timeval *time,
+		      int type, int code, int value)
+{
+	ev->time = *time;
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
+
+/* Room read_state() needs for the device's state */
+static int state_size(const struct device *dev)
+{
+	if (dev->touch_info.has_mt)
+		return dev->touch_info.ntouches * (1 + ARRAY_SIZE(mt_axes)) + 2;
+	return 3 + (BTN_WHEEL - BTN_DIGI) + 1;
+}
+
+/* The slot and key state as the kernel has it right now, as a single
+ * frame of events the same way libevdev's sync mode builds it. Returns
+ * the number of events, or 0 for protocol A devices: they resend all
+ * contacts every frame, mtdev catches up on its own there */
+static int read_state(struct device *dev, const struct timeval *time,
+		      struct input_event *ev)
+{
+	struct touch_info *touch_info = &dev->touch_info;
+	struct input_absinfo abs;
+	unsigned long keys[NLONGS(KEY_CNT)] = {0};
+	int slot, code, n = 0;
+
+	if (dev->mtdev)
+		return 0;
+
+	if (touch_info->has_mt) {
+		/* EVIOCGMTSLOTS takes the code followed by one value per
+		 * slot, one such block per axis we keep */
+		int stride = touch_info->ntouches + 1;
+		__s32 *slots;
+		unsigned int i;
+
+		slots = calloc(ARRAY_SIZE(mt_axes), stride * sizeof(*slots));
+		if (!slots)
+			return 0;
+
+		for (i = 0; i < ARRAY_SIZE(mt_axes); i++) {
+			code = mt_axes[i].code;
+			if (touch_info->axis_map[code] == -1)
+				continue;
+			slots[i * stride] = code;
+			ioctl(dev->fd, EVIOCGMTSLOTS(stride * sizeof(*slots)),
+			      &slots[i * stride]);
+		}
+
+		for (slot = 0; slot < touch_info->ntouches; slot++) {
+			set_event(&ev[n++], time, EV_ABS, ABS_MT_SLOT, slot);
+			for (i = 0; i < ARRAY_SIZE(mt_axes); i++) {
+				code = mt_axes[i].code;
+				if (touch_info->axis_map[code] == -1)
+					continue;
+				set_event(&ev[n++], time, EV_ABS, code,
+					  slots[i * stride + 1 + slot]);
+			}
+		}
+		free(slots);
+
+		if (ioctl(dev->fd, EVIOCGABS(ABS_MT_SLOT), &abs) == 0)
+			set_event(&ev[n++], time, EV_ABS, ABS_MT_SLOT, abs.value);
+	} else {
+		static const int axes[] = { ABS_X, ABS_Y, ABS_PRESSURE };
+		unsigned int i;
+
+		for (i = 0; i < ARRAY_SIZE(axes); i++) {
+			if (!libevdev_has_event_code(dev->evdev, EV_ABS, axes[i]) ||
+			    ioctl(dev->fd, EVIOCGABS(axes[i]), &abs) != 0)
+				continue;
+			set_event(&ev[n++], time, EV_ABS, axes[i], abs.value);
+		}
+
+		ioctl(dev->fd, EVIOCGKEY(sizeof(keys)), keys);
+		for (code = BTN_DIGI; code < BTN_WHEEL; code++) {
+			if (code != BTN_TOUCH &&
+			    (keys[code / LONG_BITS] & (1UL << (code % LONG_BITS))))
+				set_event(&ev[n++], time, EV_KEY, code, 1);
+		}
+	}
+
+	set_event(&ev[n++], time, EV_SYN, SYN_REPORT, 0);
+
+	return n;
+}
+
+/* Re-read the slot state from the kernel after events were lost and
+ * replay it as a single frame */
+static void resync_device(struct device *dev,
+			  const struct timeval *time)
+{
+	struct input_event *ev;
+	int n;
+
+	if (dev->mtdev)
+		return;
+
+	ev = calloc(state_size(dev), sizeof(*ev));
+	if (!ev)
+		return;
+
+	n = read_state(dev, time, ev);
+	process_events(dev, ev, n);
+	free(ev);
+}
+
+/* The kernel drops events when its buffer overflows and leaves a
+ * SYN_DROPPED in their place. Everything up to and including the next
+ * SYN_REPORT is unusable, after that the state is fetched fresh */
+static void handle_events(struct device *dev,
+			  struct input_event *ev, int n)
+{
+	int i, start = 0;
 
-	slot = touch_info->current_slot;
-	switch(ev->code) {
-		case ABS_MT_TRACKING_ID:
-			if (slot == -1)
+	for (i = 0; i < n; i++) {
+		if (ev[i].type != EV_SYN)
+			continue;
+
+		if (ev[i].code == SYN_DROPPED) {
+			if (!dev->dropped)
+				decode_events(dev, &ev[start], i - start);
+			dev->dropped = 1;
+			dev->ndropped++;
+			start = i + 1;
+		} else if (ev[i].code == SYN_REPORT && dev->dropped) {
+			dev->dropped = 0;
+			resync_device(dev, &ev[i].time);
+			start = i + 1;
+		}
+	}
+
+	if (!dev->dropped)
+		decode_events(dev, &ev[start], n - start);
+}
+
+static inline uint64_t timeval_ns(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000000 + tv->tv_usec * 1000;
+}
+
+static void heap_push(struct merge_heap *h, struct device *dev)
+{
+	int i = h->n++, parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (h->devs[parent]->next <= dev->next)
+			break;
+		h->devs[i] = h->devs[parent];
+		i = parent;
+	}
+	h->devs[i] = dev;
+}
+
+static struct device *heap_pop(struct merge_heap *h)
+{
+	struct device *top = h->devs[0], *last = h->devs[--h->n];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < h->n) {
+		if (child + 1 < h->n &&
+		    h->devs[child + 1]->next < h->devs[child]->next)
+			child++;
+		if (last->next <= h->devs[child]->next)
+			break;
+		h->devs[i] = h->devs[child];
+		i = child;
+	}
+	h->devs[i] = last;
+
+	return top;
+}
+
+/* Read up to DIM_EVENTS of what the device has queued into buf.raw,
+ * to be decoded by merge_events(). Returns the number of events, 0 if
+ * there were none or -1 once the device went away */
+static int read_events(struct device *dev)
+{
+	struct event_buffer *buf = &dev->buf;
+	ssize_t len;
+
+	do {
+		len = read(dev->fd, buf->raw, sizeof(buf->raw));
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		error("Failed to read from device (%s)\n", strerror(errno));
+		return -1;
+	} else if (len == 0)
+		return -1;
+
+	dev->read_ns = now_ns();
+	dev->nraw = len / sizeof(struct input_event);
+	dev->pos = 0;
+	dev->full = dev->nraw == ARRAY_SIZE(buf->raw);
+	dev->next = timeval_ns(&buf->raw[0].time);
+
+	return dev->nraw;
+}
+
+/* Decode whatever the devices in the heap have read, one frame at a
+ * time and always the frame with the oldest timestamp first, so frames
+ * of different devices read in the same wakeup reach the render thread
+ * in the order they happened. Nothing is held back for devices that
+ * had nothing to read, one read on a later wakeup may still hand over
+ * an older frame. A device that used up a full buffer is read again
+ * before it goes back into the heap */
+static void merge_events(struct merge_heap *h)
+{
+	struct device *dev;
+	struct input_event *ev;
+	int end;
+
+	while (h->n) {
+		dev = heap_pop(h);
+		ev = dev->buf.raw;
+
+		for (end = dev->pos; end < dev->nraw; end++)
+			if (ev[end].type == EV_SYN && ev[end].code == SYN_REPORT)
 				break;
-			touch_info->touches[slot].active = (ev->value != -1);
+		if (end < dev->nraw)
+			end++;
+
+		handle_events(dev, &ev[dev->pos], end - dev->pos);
+		dev->pos = end;
+
+		if (dev->pos < dev->nraw) {
+			dev->next = timeval_ns(&ev[dev->pos].time);
+			heap_push(h, dev);
+		} else if (dev->full && read_events(dev) > 0) {
+			heap_push(h, dev);
+		}
+	}
+}
+
+/* Input thread: the render thread asked us to stop */
+static int input_stopped(struct device_set *set)
+{
+	int i;
+
+	for (i = 0; i < set->ndevs; i++)
+		if (atomic_load_explicit(&set->devs[i]->queue->stop,
+					 memory_order_relaxed))
+			return 1;
+	return 0;
+}
+
+/* Input thread: listen for the render thread on every queue */
+static void input_watch(struct device_set *set, int epfd)
+{
+	struct epoll_event ev;
+	int i;
+
+	ev.events = EPOLLIN;
+	for (i = 0; i < set->ndevs; i++) {
+		struct frame_queue *q = set->devs[i]->queue;
+
+		ev.data.fd = q->space_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, q->space_fd, &ev);
+		ev.data.fd = q->stop_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, q->stop_fd, &ev);
+	}
+}
+
+/* Input thread: handle fd if it belongs to one of the queues. Returns
+ * -1 if it asks us to stop, 1 if it was a queue's, 0 otherwise */
+static int input_queue_event(struct device_set *set, int fd)
+{
+	int i;
+
+	for (i = 0; i < set->ndevs; i++) {
+		struct frame_queue *q = set->devs[i]->queue;
+
+		if (fd == q->stop_fd)
+			return -1;
+		if (fd == q->space_fd) {
+			eventfd_drain(q->space_fd);
+			frame_queue_flush(q);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Input thread: tell the render thread we're gone */
+static void input_done(struct device_set *set)
+{
+	int i;
+
+	for (i = 0; i < set->ndevs; i++) {
+		struct frame_queue *q = set->devs[i]->queue;
+
+		atomic_store(&q->done, 1);
+		eventfd_write(q->wake_fd, 1);
+	}
+}
+
+/* Takes over the freshly opened dev->fd: grabs it, puts its timestamps
+ * on the clock the latency is measured with and sets up mtdev for a
+ * protocol A device */
+static int claim_device(struct device *dev)
+{
+	if (ioctl(dev->fd, EVIOCGRAB, 1)) {
+		error("could not grab the device.\n");
+		error("This device may already be grabbed by "
+		      "another process (e.g. the synaptics or the wacom "
+		      "X driver)\n");
+		return -1;
+	}
+
+	dev->monotonic = ioctl(dev->fd, EVIOCSCLOCKID,
+			       &(int){ CLOCK_MONOTONIC }) == 0;
+
+	/* Only protocol A needs converting, anything else is decoded
+	 * as it comes off the fd */
+	if (dev->touch_info.has_mt && !libevdev_has_event_code(dev->evdev, EV_ABS, ABS_MT_SLOT)) {
+		dev->mtdev = mtdev_new_open(dev->fd);
+		if (!dev->mtdev) {
+			error("could not open mtdev\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Now in whatever clock the device's events are in */
+static void device_time(const struct device *dev, struct timeval *tv)
+{
+	struct timespec ts;
+
+	clock_gettime(dev->monotonic ? CLOCK_MONOTONIC : CLOCK_REALTIME, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+/* The device went away. Its contacts are lifted, everything else stays
+ * as it is for when it comes back */
+static void detach_device(struct device *dev, int epfd)
+{
+	struct touch_info *touch_info = &dev->touch_info;
+	struct frame_times times = { 0 };
+	struct timeval tv;
+	int i;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+	close(dev->fd);
+	dev->fd = -1;
+	if (dev->mtdev)
+		mtdev_close_delete(dev->mtdev);
+	dev->mtdev = NULL;
+	dev->dropped = 0;
+	dev->nraw = dev->pos = 0;
+
+	for (i = 0; i < touch_info->ntouches; i++) {
+		struct touch_data *t = &touch_info->touches[i];
+
+		if (t->active) {
+			t->active = 0;
+			t->dirty = 1;
+		}
+	}
+	device_time(dev, &tv);
+	if (dev->stats)
+		stats_frame(dev, &tv);
+	if (dev->publisher)
+		publish_frame(dev, &tv);
+	times.read = times.decoded = now_ns();
+	frame_queue_publish(dev->queue, touch_info, &times);
+	for (i = 0; i < touch_info->ntouches; i++)
+		touch_info->touches[i].dirty = 0;
+
+	msg("%s went away\n", libevdev_get_name(dev->evdev));
+}
+
+static int same_string(const char *a, const char *b)
+{
+	return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+/* Whether evdev describes the device dev was, closely enough that its
+ * contacts still map onto the same view */
+static int same_device(const struct device *dev, const struct libevdev *evdev)
+{
+	const struct touch_info *ti = &dev->touch_info;
+	const struct libevdev *old = dev->evdev;
+	int code_x = ti->has_mt ? ABS_MT_POSITION_X : ABS_X;
+	int code_y = ti->has_mt ? ABS_MT_POSITION_Y : ABS_Y;
+
+	if (!same_string(libevdev_get_name(old), libevdev_get_name(evdev)))
+		return 0;
+
+	/* uniq survives a move to another port, phys doesn't */
+	if (libevdev_get_uniq(old) && *libevdev_get_uniq(old)) {
+		if (!same_string(libevdev_get_uniq(old),
+				 libevdev_get_uniq(evdev)))
+			return 0;
+	} else if (!same_string(libevdev_get_phys(old),
+				libevdev_get_phys(evdev))) {
+		return 0;
+	}
+
+	return libevdev_get_abs_minimum(evdev, code_x) == ti->minx &&
+	       libevdev_get_abs_maximum(evdev, code_x) == ti->maxx &&
+	       libevdev_get_abs_minimum(evdev, code_y) == ti->miny &&
+	       libevdev_get_abs_maximum(evdev, code_y) == ti->maxy &&
+	       (!ti->has_mt || libevdev_get_num_slots(evdev) <= 0 ||
+		libevdev_get_num_slots(evdev) == ti->ntouches);
+}
+
+/* Whether a device called name is among those that went away */
+static int detached_name(const struct device_set *set, const char *name)
+{
+	int i;
+
+	for (i = 0; i < set->ndevs; i++)
+		if (set->devs[i]->fd < 0 &&
+		    same_string(libevdev_get_name(set->devs[i]->evdev), name))
+			return 1;
+	return 0;
+}
+
+/* A node appeared under /dev/input, see whether it's one of the devices
+ * that went away and pick it up where it left off. Returns 1 if it
+ * was */
+static int reattach_device(struct device_set *set, const char *node, int epfd)
+{
+	struct libevdev *evdev = NULL;
+	struct epoll_event ev;
+	struct device *dev;
+	struct timeval tv;
+	char path[PATH_MAX], name[256];
+	int fd, i;
+
+	/* leave the ones that can't be ours alone, without opening them */
+	if (discover_name(node, name, sizeof(name)) == 0 &&
+	    !detached_name(set, name))
+		return 0;
+
+	snprintf(path, sizeof(path), "%s/%s", DEV_INPUT_EVENT, node);
+	fd = open(path, O_RDONLY | O_NONBLOCK);
+	/* udev may not have fixed the permissions yet, there'll be an
+	 * IN_ATTRIB once it has */
+	if (fd < 0)
+		return 0;
+
+	if (libevdev_new_from_fd(fd, &evdev) != 0)
+		goto fail;
+
+	for (i = 0; i < set->ndevs; i++) {
+		dev = set->devs[i];
+		if (dev->fd < 0 && same_device(dev, evdev))
 			break;
-		case ABS_MT_SLOT:
-			slot = ev->value;
-			if (ev->value >= DIM_TOUCH) {
-				msg("Too many simultaneous touches.\n");
-				slot = -1;
-			}
-			touch_info->current_slot = slot;
+	}
+	if (i == set->ndevs)
+		goto fail;
+
+	dev->fd = fd;
+	libevdev_free(dev->evdev);
+	dev->evdev = evdev;
+	if (claim_device(dev) != 0) {
+		dev->fd = -1;
+		goto fail_grabbed;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+	/* whatever is touching it now, as one frame */
+	device_time(dev, &tv);
+	resync_device(dev, &tv);
+
+	msg("%s is back as %s\n", libevdev_get_name(evdev), path);
+	return 1;
+
+fail_grabbed:
+	ioctl(fd, EVIOCGRAB, 0);
+	close(fd);
+	return 0;
+
+fail:
+	if (evdev)
+		libevdev_free(evdev);
+	close(fd);
+	return 0;
+}
+
+/* Watch /dev/input for nodes being created or becoming accessible.
+ * Returns the inotify fd or -1 */
+static int hotplug_init(int epfd)
+{
+	struct epoll_event ev;
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (inotify_add_watch(fd, DEV_INPUT_EVENT, IN_CREATE | IN_ATTRIB) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+	return fd;
+}
+
+/* Returns the number of devices that came back */
+static int hotplug_event(struct device_set *set, int fd, int epfd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ie;
+	ssize_t len;
+	char *p;
+	int n = 0;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ie) + ie->len) {
+			ie = (const struct inotify_event *)p;
+			if (!ie->len ||
+			    strncmp(ie->name, EVENT_DEV_NAME,
+				    strlen(EVENT_DEV_NAME)) != 0)
+				continue;
+
+			n += reattach_device(set, ie->name, epfd);
+		}
+	}
+
+	return n;
+}
+
+/* Reads and decodes the devices until they all went away or the
+ * render thread asks us to stop. With hotplug, devices that went away
+ * are waited for instead */
+static void *input_thread(void *data)
+{
+	struct device_set *set = data;
+	struct merge_heap heap = { .n = 0 };
+	struct epoll_event ev, events[3 * DIM_DEVICES];
+	struct device *dev;
+	int epfd, hotplug_fd = -1, nlive = set->ndevs;
+	int i, j, n, rc;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		error("Failed to create epoll fd (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	ev.events = EPOLLIN;
+	for (i = 0; i < set->ndevs; i++) {
+		ev.data.fd = set->devs[i]->fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, set->devs[i]->fd, &ev);
+	}
+	input_watch(set, epfd);
+	if (set->hotplug) {
+		hotplug_fd = hotplug_init(epfd);
+		if (hotplug_fd < 0)
+			error("Failed to watch %s (%s), devices that go away "
+			      "stay away\n", DEV_INPUT_EVENT, strerror(errno));
+	}
+
+	while (nlive || hotplug_fd >= 0) {
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			switch (input_queue_event(set, fd)) {
+			case -1:
+				goto out;
+			case 1:
+				continue;
+			}
+
+			if (fd == hotplug_fd) {
+				nlive += hotplug_event(set, hotplug_fd, epfd);
+				continue;
+			}
+
+			for (j = 0; j < set->ndevs; j++) {
+				dev = set->devs[j];
+				if (fd != dev->fd)
+					continue;
+
+				rc = read_events(dev);
+				if (rc > 0) {
+					heap_push(&heap, dev);
+				} else if (rc < 0 ||
+					   (events[i].events & (EPOLLHUP|EPOLLERR))) {
+					/* the others carry on without it */
+					detach_device(dev, epfd);
+					nlive--;
+				}
+				break;
+			}
+		}
+
+		merge_events(&heap);
 	}
-	if (slot == -1)
+
+out:
+	if (hotplug_fd >= 0)
+		close(hotplug_fd);
+	if (epfd >= 0)
+		close(epfd);
+
+	input_done(set);
+
+	return NULL;
+}
+
+/* Replay thread: whether any queue still holds a frame that didn't
+ * fit */
+static int input_pending(struct device_set *set)
+{
+	int i;
+
+	for (i = 0; i < set->ndevs; i++)
+		if (set->devs[i]->queue->has_pending)
+			return 1;
+	return 0;
+}
+
+/* Replay thread: block until the frame timer fires or, without a
+ * timer, until the pending frames made it into the rings. Returns -1
+ * if the render thread asked us to stop */
+static int replay_wait(struct device_set *set, int epfd, int timer_fd)
+{
+	struct epoll_event events[1 + 2 * DIM_DEVICES];
+	uint64_t expirations;
+	int expired = 0;
+	int i, n;
+
+	while (timer_fd >= 0 ? !expired : input_pending(set)) {
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (input_queue_event(set, fd) < 0)
+				return -1;
+			else if (fd == timer_fd &&
+				 read(timer_fd, &expirations,
+				      sizeof(expirations)) > 0)
+				expired = 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Replay thread: decode the next frame of a capture into buf.events.
+ * Returns the number of events, 0 at the end or -1 if it's corrupt */
+static int replay_next(struct device *dev)
+{
+	struct input_event *ev = dev->buf.events;
+	int n;
+
+	n = capture_read(dev->replay, ev, ARRAY_SIZE(dev->buf.events));
+	if (n > 0) {
+		dev->nraw = n;
+		dev->next = timeval_ns(&ev[n - 1].time);
+	} else if (n < 0) {
+		error("Capture is truncated\n");
+	}
+
+	return n;
+}
+
+/* Sets up the contacts that were already down when the capture was
+ * recorded, stamped with the time of its first frame */
+static void replay_state(struct device *dev)
+{
+	struct input_event *ev;
+	int i, n;
+
+	ev = calloc(state_size(dev), sizeof(*ev));
+	if (!ev)
 		return;
 
-	if (!touch_info->has_mt) {
-		switch(ev->code) {
-			case ABS_X: ev->code = ABS_MT_POSITION_X; break;
-			case ABS_Y: ev->code = ABS_MT_POSITION_Y; break;
-			case ABS_PRESSURE: ev->code = ABS_MT_PRESSURE; break;
-			default:
-				break;
+	n = capture_reader_state(dev->replay, ev, state_size(dev));
+	for (i = 0; i < n; i++)
+		ev[i].time = dev->buf.events[0].time;
+	if (n > 0) {
+		dev->read_ns = now_ns();
+		process_events(dev, ev, n);
+	}
+	free(ev);
+}
+
+/* Feeds the captures through the decoder one frame at a time, in the
+ * order they were recorded across all of them, each one released at
+ * its recorded time divided by the replay speed. With a speed of 0
+ * nothing ever waits and the throughput is reported */
+static void *replay_thread(void *data)
+{
+	struct device_set *set = data;
+	struct merge_heap heap = { .n = 0 };
+	struct device *dev;
+	struct epoll_event epev;
+	struct itimerspec its;
+	unsigned long long nevents = 0;
+	unsigned int nframes = 0;
+	uint64_t start, elapsed, due, first = 0;
+	double secs, speed = set->devs[0]->speed;
+	int epfd, timer_fd = -1;
+	int i;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		error("Failed to create epoll fd (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	epev.events = EPOLLIN;
+	if (speed > 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_CLOEXEC|TFD_NONBLOCK);
+		if (timer_fd < 0) {
+			error("Failed to create replay timer (%s)\n",
+			      strerror(errno));
+			goto out;
 		}
+		epev.data.fd = timer_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &epev);
+	}
+	input_watch(set, epfd);
+
+	for (i = 0; i < set->ndevs; i++) {
+		if (replay_next(set->devs[i]) > 0) {
+			replay_state(set->devs[i]);
+			heap_push(&heap, set->devs[i]);
+		}
+	}
+
+	start = now_ns();
+	while (heap.n && !input_stopped(set)) {
+		dev = heap_pop(&heap);
+
+		if (nevents == 0)
+			first = dev->next;
+		nevents += dev->nraw;
+
+		if (timer_fd >= 0 && dev->next > first) {
+			due = start + (uint64_t)((dev->next - first) / speed);
+			if (due > now_ns()) {
+				memset(&its, 0, sizeof(its));
+				its.it_value.tv_sec = due / 1000000000;
+				its.it_value.tv_nsec = due % 1000000000;
+				timerfd_settime(timer_fd, TFD_TIMER_ABSTIME,
+						&its, NULL);
+				if (replay_wait(set, epfd, timer_fd) < 0)
+					goto out;
+			}
+		}
+
+		dev->read_ns = now_ns();
+		process_events(dev, dev->buf.events, dev->nraw);
 
+		if (replay_next(dev) > 0)
+			heap_push(&heap, dev);
 	}
-	touch_info->touches[slot].data[ev->code] = ev->value;
+	elapsed = now_ns() - start;
+
+	/* the last frame is the one that matters most */
+	if (replay_wait(set, epfd, -1) < 0)
+		goto out;
+
+	for (i = 0; i < set->ndevs; i++)
+		nframes += set->devs[i]->queue->nframes;
+
+	secs = elapsed / 1e9;
+	if (secs > 0)
+		msg("Replayed %llu events, %u frames in %.3fs "
+		    "(%.0f events/s, %.0f frames/s)\n",
+		    nevents, nframes, secs,
+		    nevents / secs, nframes / secs);
+
+out:
+	if (timer_fd >= 0)
+		close(timer_fd);
+	if (epfd >= 0)
+		close(epfd);
+
+	input_done(set);
+
+	return NULL;
+}
+
+/* Take everything out of the queue into the view, keeping only the
+ * newest frame, but with every contact that changed in any of them
+ * marked dirty. With trails enabled the intermediate positions are
+ * recorded first. Returns 1 if there was a new frame */
+static int consume_frames(struct frame_queue *q, struct windata *w,
+			  struct view *v)
+{
+	unsigned int begin, end, i;
+
+	if (frame_queue_peek(q, &begin, &end) == 0)
+		return 0;
+
+	for (i = begin; i != end; i++) {
+		const struct frame *f = &q->frames[i % DIM_FRAMES];
+
+		if (w->opts->trails)
+			trail_add(&f->touch_info, v);
+		v->frame.times = f->times;
+		touch_info_replace(&v->frame.touch_info, &f->touch_info);
+	}
+	frame_queue_release(q, end);
+	v->fresh = 1;
+
+	return 1;
+}
+
+static int stats_init(struct device *dev, struct view *v,
+		      const struct options *opts)
+{
+	if (!opts->stats && !opts->stats_dump)
+		return 0;
+
+	dev->stats = stats_new(dev->touch_info.ntouches, NAXES);
+	if (!dev->stats)
+		return -1;
+
+	if (opts->stats) {
+		dev->overlay = calloc(1, sizeof(*dev->overlay));
+		if (!dev->overlay)
+			return -1;
+		pthread_mutex_init(&dev->overlay->lock, NULL);
+		atomic_init(&dev->overlay->updated, 0);
+		v->overlay = dev->overlay;
+	}
+
+	return 0;
+}
+
+/* With more than one device each gets its own object, the name
+ * followed by a dot and its position on the command line */
+static int publish_init(struct device *dev, int index, int ndevs,
+			const struct options *opts)
+{
+	struct touch_info *ti = &dev->touch_info;
+	char name[NAME_MAX];
+
+	if (!opts->publish)
+		return 0;
+
+	if (ndevs > 1)
+		snprintf(name, sizeof(name), "/%s.%d", opts->publish, index);
+	else
+		snprintf(name, sizeof(name), "/%s", opts->publish);
+
+	dev->publisher = publisher_create(name, libevdev_get_name(dev->evdev),
+					  ti->ntouches, NAXES,
+					  ti->minx, ti->maxx, ti->miny, ti->maxy);
+	if (!dev->publisher) {
+		error("Failed to create %s (%s)\n", name, strerror(errno));
+		if (errno == EEXIST)
+			error("Another mtview may be publishing there, or one "
+			      "that crashed left it behind\n");
+		return -1;
+	}
+	msg("Publishing frames in /dev/shm%s\n", name);
+
+	return 0;
 }
 
-static int handle_event(struct input_event *ev, struct touch_info *touch_info)
+/* Once the input thread is gone. With more than one device the dump
+ * is an array of them */
+static void stats_finish(struct device_set *set, const struct options *opts)
 {
-	if (ev->type == EV_SYN && ev->code == SYN_REPORT)
-		return 1;
+	FILE *fp = NULL;
+	int i;
 
-	if (ev->type == EV_ABS)
-		handle_abs_event(ev, touch_info);
-	if (ev->type == EV_KEY)
-		handle_key_event(ev, touch_info);
+	if (set->devs[0]->stats && opts->stats_dump) {
+		if (strcmp(opts->stats_dump, "-") == 0)
+			fp = stdout;
+		else
+			fp = fopen(opts->stats_dump, "w");
+		if (!fp)
+			error("Failed to write %s (%s)\n", opts->stats_dump,
+			      strerror(errno));
+	}
 
-	return 0;
+	if (fp && set->ndevs > 1)
+		fprintf(fp, "[\n");
+	for (i = 0; i < set->ndevs; i++) {
+		struct device *dev = set->devs[i];
+
+		if (fp && dev->stats) {
+			if (i)
+				fprintf(fp, ",\n");
+			stats_dump(fp, dev->stats, axis_names);
+		}
+
+		if (dev->stats)
+			stats_destroy(dev->stats);
+		if (dev->overlay) {
+			pthread_mutex_destroy(&dev->overlay->lock);
+			free(dev->overlay);
+		}
+		dev->stats = NULL;
+		dev->overlay = NULL;
+	}
+	if (fp && set->ndevs > 1)
+		fprintf(fp, "]\n");
+
+	if (fp && fp != stdout)
+		fclose(fp);
 }
 
-static void run_window_mtdev(struct touch_info *touch_info,
-			     struct mtdev *dev, int fd)
+static void run_window_mtdev(struct device_set *set,
+			     const struct options *opts)
 {
-	struct input_event iev;
 	struct windata w;
-	XEvent xev;
-	struct pollfd fds[2];
-
-	if (init_window(&w)) {
+	struct touch_info *touch_info[DIM_DEVICES];
+	struct pacer pacer = { .fd = -1 };
+	struct fade fade = { .fd = -1 };
+	struct epoll_event ev, events[4 + DIM_DEVICES];
+	pthread_t thread;
+	int epfd = -1, sigfd = -1;
+	int i, j, n, fresh, done, started = 0;
+	unsigned int nframes = 0, nrendered = 0;
+
+	for (i = 0; i < set->ndevs; i++)
+		touch_info[i] = &set->devs[i]->touch_info;
+
+	if (init_window(&w, opts) ||
+	    init_views(&w, set->ndevs, touch_info) ||
+	    init_canvas(&w)) {
 		error("Failed to open window.\n");
 		return;
 	}
 
-	clear_screen(touch_info, &w);
+	clear_screen(&w);
 
 	set_screen_size_mtdev(&w, 0);
 
-	fds[0].fd = fd;
-	fds[0].events = POLLIN;
-	fds[0].revents = 0;
-	fds[1].fd = ConnectionNumber(w.dsp);
-	fds[1].events = POLLIN;
-	fds[1].revents = 0;
-
-	while (poll(fds, 2, -1) != -1) {
-		while (!mtdev_idle(dev, fd, 100)) {
-			while (mtdev_get(dev, fd, &iev, 1) > 0) {
-				if (handle_event(&iev, touch_info))
-					report_frame(touch_info, &w);
+	for (i = 0; i < set->ndevs; i++) {
+		struct device *dev = set->devs[i];
+
+		dev->queue = frame_queue_new(dev->touch_info.ntouches);
+		if (!dev->queue) {
+			error("Failed to create frame queue\n");
+			goto out;
+		}
+		if (stats_init(dev, &w.views[i], opts)) {
+			error("Failed to allocate statistics\n");
+			goto out;
+		}
+		if (publish_init(dev, i, set->ndevs, opts))
+			goto out;
+	}
+
+	if (pacer_init(&pacer, opts->rate) ||
+	    fade_init(&fade, &w, opts->fade, opts->rate)) {
+		error("Failed to create frame timer (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		error("Failed to create epoll fd (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	ev.events = EPOLLIN;
+	if (fade.fd >= 0) {
+		ev.data.fd = fade.fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fade.fd, &ev);
+	}
+	for (i = 0; i < set->ndevs; i++) {
+		ev.data.fd = set->devs[i]->queue->wake_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+	}
+	ev.data.fd = window_fd(&w);
+	if (ev.data.fd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+	if (pacer.fd >= 0) {
+		ev.data.fd = pacer.fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, pacer.fd, &ev);
+	}
+	sigfd = latency_signal_init(&w);
+	if (sigfd >= 0) {
+		ev.data.fd = sigfd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+	}
+
+	if (pthread_create(&thread, NULL,
+			   set->devs[0]->replay ? replay_thread : input_thread,
+			   set) != 0) {
+		error("Failed to start input thread\n");
+		goto out;
+	}
+	started = 1;
+
+	while (1) {
+		/* sampled before consuming, whatever was published before
+		 * the input thread exited still gets drawn */
+		done = atomic_load(&set->devs[0]->queue->done);
+
+		/* Xlib may have queued events while we were busy writing,
+		 * those won't show up as readable on the socket */
+		dispatch_window(&w);
+
+		fresh = 0;
+		for (i = 0; i < set->ndevs; i++)
+			fresh |= consume_frames(set->devs[i]->queue, &w,
+						&w.views[i]);
+		if (fresh && pacer_schedule(&pacer)) {
+			report_frame(&w);
+			pacer_rendered(&pacer);
+		}
+
+		if (done)
+			break;
+
+		fade_schedule(&fade, &w);
+
+		for (i = 0; i < set->ndevs; i++)
+			if (frame_queue_prepare_wait(set->devs[i]->queue) < 0)
+				break;
+		if (i < set->ndevs)
+			continue;
+
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == sigfd) {
+				latency_signalled(sigfd, &w);
+			} else if (fd == fade.fd) {
+				fade_expired(&fade, &w);
+			} else if (fd == pacer.fd) {
+				if (pacer_expired(&pacer)) {
+					report_frame(&w);
+					pacer_rendered(&pacer);
+				}
+			} else {
+				for (j = 0; j < set->ndevs; j++)
+					if (fd == set->devs[j]->queue->wake_fd)
+						eventfd_drain(fd);
 			}
 		}
-		while (XPending(w.dsp)) {
-			XNextEvent(w.dsp, &xev);
-			if (xev.type == ConfigureNotify)
-				set_screen_size_mtdev(&w, &xev);
+	}
+
+	if (pacer.pending) {
+		report_frame(&w);
+		pacer_rendered(&pacer);
+	}
+
+out:
+	if (started) {
+		for (i = 0; i < set->ndevs; i++) {
+			struct frame_queue *q = set->devs[i]->queue;
+
+			atomic_store(&q->stop, 1);
+			eventfd_write(q->stop_fd, 1);
+		}
+		pthread_join(thread, NULL);
+
+		for (i = 0; i < set->ndevs; i++) {
+			nframes += set->devs[i]->queue->nframes;
+			nrendered += set->devs[i]->queue->nrendered;
 		}
+		msg("Rendered %u of %u frames\n", nrendered, nframes);
 	}
 
+	stats_finish(set, opts);
+	if (sigfd >= 0)
+		close(sigfd);
+	if (epfd >= 0)
+		close(epfd);
+	pacer_destroy(&pacer);
+	fade_destroy(&fade);
+	for (i = 0; i < set->ndevs; i++) {
+		if (set->devs[i]->queue)
+			frame_queue_destroy(set->devs[i]->queue);
+		set->devs[i]->queue = NULL;
+		if (set->devs[i]->publisher)
+			publisher_destroy(set->devs[i]->publisher);
+		set->devs[i]->publisher = NULL;
+	}
 	term_window(&w);
 }
 
@@ -426,9 +3248,25 @@ static int is_mt_device(const struct libevdev *dev)
 	       libevdev_has_event_code(dev, EV_ABS, ABS_MT_POSITION_Y);
 }
 
-static void init_single_touch(const struct libevdev *dev,
-			      struct touch_info *t)
+static int alloc_touches(struct touch_info *t)
+{
+	int i;
+
+	t->touches = calloc(t->ntouches, sizeof(*t->touches));
+	if (!t->touches)
+		return -1;
+
+	for (i = 0; i < t->ntouches; i++)
+		t->touches[i].axes[AXIS_TRACKING_ID] = -1;
+
+	return 0;
+}
+
+static int init_single_touch(const struct libevdev *dev,
+			     struct touch_info *t)
 {
+	unsigned int i;
+
 	t->has_mt = 0;
 	t->ntouches = 1;
 	t->current_slot = 0;
@@ -441,17 +3279,31 @@ static void init_single_touch(const struct libevdev *dev,
 	t->has_touch_major = 0;
 	t->has_touch_minor = 0;
 
+	memset(t->axis_map, -1, sizeof(t->axis_map));
+	for (i = 0; i < ARRAY_SIZE(st_axes); i++)
+		if (libevdev_has_event_code(dev, EV_ABS, st_axes[i].code))
+			t->axis_map[st_axes[i].code] = st_axes[i].axis;
+
+	if (alloc_touches(t))
+		return -1;
+
 	t->touches[0].active = 1;
-	memset(t->touches[0].data, 0, sizeof(t->touches[0].data));
+	t->touches[0].axes[AXIS_TRACKING_ID] = 0;
+
+	return 0;
 }
 
-static void init_touches(const struct libevdev *dev,
-			 struct touch_info *t)
+static int init_touches(const struct libevdev *dev,
+			struct touch_info *t)
 {
-	int i, code;
+	unsigned int i, slot;
 
 	t->has_mt = 1;
-	t->ntouches = min(libevdev_get_num_slots(dev), DIM_TOUCH);
+	/* protocol A has no slots, mtdev hands out up to DIM_TOUCH */
+	if (libevdev_has_event_code(dev, EV_ABS, ABS_MT_SLOT))
+		t->ntouches = libevdev_get_num_slots(dev);
+	else
+		t->ntouches = DIM_TOUCH;
 	t->current_slot = libevdev_get_current_slot(dev);
 
 	t->minx = libevdev_get_abs_minimum(dev, ABS_MT_POSITION_X);
@@ -463,123 +3315,277 @@ static void init_touches(const struct libevdev *dev,
 	t->has_touch_major = libevdev_has_event_code(dev, EV_ABS, ABS_MT_TOUCH_MAJOR);
 	t->has_touch_minor = libevdev_has_event_code(dev, EV_ABS, ABS_MT_TOUCH_MINOR);
 
-	for (i = 0; i < t->ntouches; i++) {
-		t->touches[i].active = 0;
-		memset(t->touches[i].data, 0, sizeof(t->touches[i].data));
-		t->touches[i].data[ABS_MT_TRACKING_ID] = -1;
-		t->touches[i].data[ABS_MT_SLOT] = -1;
+	/* only the axes the device has, everything else is never stored */
+	memset(t->axis_map, -1, sizeof(t->axis_map));
+	for (i = 0; i < ARRAY_SIZE(mt_axes); i++)
+		if (libevdev_has_event_code(dev, EV_ABS, mt_axes[i].code))
+			t->axis_map[mt_axes[i].code] = mt_axes[i].axis;
+	t->axis_map[ABS_MT_TRACKING_ID] = AXIS_TRACKING_ID;
 
-		for (code = ABS_MT_SLOT + 1; code < ABS_CNT; code++) {
-			if (libevdev_has_event_code(dev, EV_ABS, code)) {
-				t->touches[i].data[code] = libevdev_get_slot_value(dev, i, code);
-			}
-		}
+	if (alloc_touches(t))
+		return -1;
 
+	if (t->current_slot == -1)
+		return 0;
+
+	for (slot = 0; slot < t->ntouches; slot++) {
+		struct touch_data *touch = &t->touches[slot];
+
+		for (i = 0; i < ARRAY_SIZE(mt_axes); i++)
+			if (t->axis_map[mt_axes[i].code] != -1)
+				touch->axes[mt_axes[i].axis] =
+					libevdev_get_slot_value(dev, slot,
+								mt_axes[i].code);
+		touch->active = (touch->axes[AXIS_TRACKING_ID] != -1);
+		touch->dirty = touch->active;
 	}
+
+	return 0;
 }
 
-static int run_mtdev(const char *name)
+static void close_device(struct device *dev)
 {
-	struct libevdev *evdev;
-	struct mtdev *mtdev;
-	struct touch_info t;
-	int fd, rc;
-
-	fd = open(name, O_RDONLY | O_NONBLOCK);
-	if (fd < 0) {
-		error("could not open device (%s)\n", strerror(errno));
-		return -1;
+	if (dev->ndropped)
+		msg("Kernel dropped events %u times (SYN_DROPPED)\n",
+		    dev->ndropped);
+
+	if (dev->capture)
+		msg("Recorded %llu bytes to %s\n",
+		    (unsigned long long)capture_close(dev->capture),
+		    dev->record);
+
+	if (dev->mtdev)
+		mtdev_close_delete(dev->mtdev);
+	if (dev->evdev)
+		libevdev_free(dev->evdev);
+	if (dev->replay)
+		capture_reader_close(dev->replay);
+	free(dev->touch_info.touches);
+
+	if (dev->fd >= 0) {
+		ioctl(dev->fd, EVIOCGRAB, 0);
+		close(dev->fd);
 	}
-	if (ioctl(fd, EVIOCGRAB, 1)) {
-		error("could not grab the device.\n");
-		error("This device may already be grabbed by "
-		      "another process (e.g. the synaptics or the wacom "
-		      "X driver)\n");
-		return -1;
+	free(dev);
+}
+
+static struct device *open_device(const char *name, const struct options *opts)
+{
+	struct device *dev;
+	int rc;
+
+	/* too big for the stack with the event buffers */
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	dev->fd = open(name, O_RDONLY | O_NONBLOCK);
+	if (dev->fd < 0) {
+		error("could not open %s (%s)\n", name, strerror(errno));
+		goto err;
 	}
 
-	rc = libevdev_new_from_fd(fd, &evdev);
+	rc = libevdev_new_from_fd(dev->fd, &dev->evdev);
 	if (rc != 0) {
 		error("could not describe device: %s\n",
 		      strerror(-rc));
-		return -1;
+		goto err;
 	}
 
-	mtdev = mtdev_new_open(fd);
-	if (!mtdev) {
-		error("could not open mtdev\n");
-		return -1;
+	if (is_mt_device(dev->evdev))
+		rc = init_touches(dev->evdev, &dev->touch_info);
+	else {
+		msg("%s is not a multitouch device\n", name);
+		rc = init_single_touch(dev->evdev, &dev->touch_info);
+	}
+	if (rc != 0) {
+		error("could not allocate touches\n");
+		goto err;
 	}
 
+	if (claim_device(dev) != 0) {
+		ioctl(dev->fd, EVIOCGRAB, 0);
+		close(dev->fd);
+		dev->fd = -1;
+		goto err;
+	}
 
-	if (is_mt_device(evdev))
-		init_touches(evdev, &t);
-	else {
-		msg("This a not a multitouch device\n");
-		init_single_touch(evdev, &t);
+	if (opts->record) {
+		struct timeval tv = { 0 };
+		struct input_event *state;
+		int nstate;
+
+		/* contacts already down have no events of their own */
+		state = calloc(state_size(dev), sizeof(*state));
+		if (!state)
+			goto err;
+		nstate = read_state(dev, &tv, state);
+
+		dev->record = opts->record;
+		dev->capture = capture_create(opts->record, dev->evdev,
+					      dev->mtdev ? dev->touch_info.ntouches : 0,
+					      state, nstate);
+		free(state);
+		if (!dev->capture) {
+			error("could not create %s (%s)\n",
+			      opts->record, strerror(errno));
+			goto err;
+		}
 	}
 
-	libevdev_free(evdev);
-	evdev = NULL;
+	return dev;
 
-	run_window_mtdev(&t, mtdev, fd);
+err:
+	close_device(dev);
+	return NULL;
+}
 
-	mtdev_close_delete(mtdev);
+/* Shows all the named devices in one window */
+static int run_mtdev(char **names, int ndevs, const struct options *opts)
+{
+	struct device_set set = { .ndevs = 0, .hotplug = !opts->no_hotplug };
+	int i, rc = -1;
 
-	ioctl(fd, EVIOCGRAB, 0);
-	close(fd);
+	if (ndevs > DIM_DEVICES) {
+		error("At most %d devices\n", DIM_DEVICES);
+		return -1;
+	}
+	if (ndevs > 1 && opts->record) {
+		error("Only a single device can be recorded\n");
+		return -1;
+	}
 
-	return 0;
+	for (i = 0; i < ndevs; i++) {
+		set.devs[i] = open_device(names[i], opts);
+		if (!set.devs[i])
+			goto out;
+		set.ndevs++;
+	}
+
+	run_window_mtdev(&set, opts);
+	rc = 0;
+
+out:
+	for (i = 0; i < set.ndevs; i++)
+		close_device(set.devs[i]);
+
+	return rc;
 }
 
-#define DEV_INPUT_EVENT "/dev/input"
-#define EVENT_DEV_NAME "event"
+/* Plays back captures through the same decoder and renderer as live
+ * devices. The device descriptions come from the captures themselves,
+ * nothing under /dev/input is touched */
+static int run_replay(char **paths, int ndevs, const struct options *opts)
+{
+	struct device_set set = { .ndevs = 0 };
+	struct device *dev;
+	int i, rc = -1;
+
+	if (ndevs > DIM_DEVICES) {
+		error("At most %d captures\n", DIM_DEVICES);
+		return -1;
+	}
+
+	for (i = 0; i < ndevs; i++) {
+		dev = calloc(1, sizeof(*dev));
+		if (!dev)
+			goto out;
+		dev->fd = -1;
+		dev->speed = opts->speed;
+		set.devs[set.ndevs++] = dev;
+
+		dev->replay = capture_reader_open(paths[i]);
+		if (!dev->replay) {
+			error("could not open %s (%s)\n", paths[i],
+			      strerror(errno));
+			goto out;
+		}
 
-static int is_event_device(const struct dirent *dir) {
-	return strncmp(EVENT_DEV_NAME, dir->d_name, 5) == 0;
+		dev->evdev = capture_reader_device(dev->replay);
+		if (!dev->evdev) {
+			error("%s is not a valid capture\n", paths[i]);
+			goto out;
+		}
+
+		if ((is_mt_device(dev->evdev) ?
+		     init_touches(dev->evdev, &dev->touch_info) :
+		     init_single_touch(dev->evdev, &dev->touch_info)) != 0) {
+			error("could not allocate touches\n");
+			goto out;
+		}
+
+		msg("Replaying %s\n", libevdev_get_name(dev->evdev));
+	}
+
+	run_window_mtdev(&set, opts);
+	rc = 0;
+
+out:
+	for (i = 0; i < set.ndevs; i++)
+		close_device(set.devs[i]);
+
+	return rc;
 }
 
 static char* scan_devices(void)
 {
-	struct dirent **namelist;
-	int i, ndev, devnum;
-	char *filename;
+	struct input_node *nodes;
+	int i, n, devnum;
+	char *filename = NULL;
 
-	ndev = scandir(DEV_INPUT_EVENT, &namelist, is_event_device, versionsort);
-	if (ndev <= 0)
-		return NULL;
+	n = discover_devices(&nodes);
+	if (n <= 0)
+		goto out;
+
+	/* nothing to choose from */
+	if (n == 1) {
+		msg("Using %s: %s\n", nodes[0].path, nodes[0].name);
+		filename = strdup(nodes[0].path);
+		goto out;
+	}
 
 	fprintf(stderr, "Available devices:\n");
 
-	for (i = 0; i < ndev; i++)
-	{
-		char fname[64];
-		int fd = -1;
-		char name[256] = "???";
+	for (i = 0; i < n; i++)
+		fprintf(stderr, "%s:	%s\n", nodes[i].path, nodes[i].name);
 
-		snprintf(fname, sizeof(fname),
-			 "%s/%s", DEV_INPUT_EVENT, namelist[i]->d_name);
-		fd = open(fname, O_RDONLY);
-		if (fd < 0)
-			continue;
-		ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+	fprintf(stderr, "Select the device event number: ");
+	if (scanf("%d", &devnum) != 1)
+		goto out;
 
-		fprintf(stderr, "%s:	%s\n", fname, name);
-		close(fd);
-		free(namelist[i]);
+	for (i = 0; i < n; i++) {
+		if (nodes[i].number == devnum) {
+			filename = strdup(nodes[i].path);
+			break;
+		}
 	}
 
-	fprintf(stderr, "Select the device event number [0-%d]: ", ndev - 1);
-	scanf("%d", &devnum);
+out:
+	free(nodes);
+	return filename;
+}
 
-	if (devnum >= ndev || devnum < 0)
-		return NULL;
+/* Every touch device whose name contains match, at most max of them.
+ * Returns how many there were, their paths are for the caller to
+ * free */
+static int find_devices(const char *match, char **paths, int max)
+{
+	struct input_node *nodes;
+	int i, n, count = 0;
 
-	asprintf(&filename, "%s/%s%d",
-		 DEV_INPUT_EVENT, EVENT_DEV_NAME,
-		 devnum);
+	n = discover_devices(&nodes);
 
-	return filename;
+	for (i = 0; i < n && count < max; i++) {
+		if (!strstr(nodes[i].name, match))
+			continue;
+		msg("Using %s: %s\n", nodes[i].path, nodes[i].name);
+		paths[count] = strdup(nodes[i].path);
+		if (paths[count])
+			count++;
+	}
+	free(nodes);
+
+	return count;
 }
 
 static int scan_devices_xi2(void)
@@ -676,163 +3682,365 @@ static int init_device(Display *dpy, int deviceid, struct touch_info *ti) {
 		}
 	}
 
-	if (ti->ntouches > DIM_TOUCH) {
-		msg("Device claims to support %d touches. Clamping to %d.\n", ti->ntouches, DIM_TOUCH);
+	XIFreeDeviceInfo(info);
+
+	if (ti->ntouches == 0) {
+		msg("Device doesn't say how many touches it supports. Using %d.\n", DIM_TOUCH);
 		ti->ntouches = DIM_TOUCH;
 	}
 
-	for (i = 0; i < ti->ntouches; i++) {
-		ti->touches[i].active = 0;
-		memset(ti->touches[i].data, 0, sizeof(ti->touches[i].data));
-		ti->touches[i].data[ABS_MT_TRACKING_ID] = -1;
-		ti->touches[i].data[ABS_MT_SLOT] = -1;
-	}
+	/* valuators are mapped in handle_xi2_event() */
+	memset(ti->axis_map, -1, sizeof(ti->axis_map));
 
-	return 0;
+	return alloc_touches(ti);
 }
 
-static void handle_xi2_event(Display *dpy, XEvent *e, struct touch_info *ti)
+/* The slot each XI2 touch id was last put in, indexed by the low bits
+ * of the id. The server hands ids out in increasing order, so the few
+ * that are active at a time rarely share an entry, and when they do
+ * the slot's tracking id tells and we fall back to searching */
+struct touch_ids {
+	int slot[DIM_TOUCH_IDS];
+};
+
+/* Applies a touch event to the view of the device it came from, whose
+ * id is at the same index in deviceids. Returns that index or -1 if
+ * nothing changed */
+static int handle_xi2_event(Display *dpy, XEvent *e, struct windata *w,
+			    const int *deviceids, struct touch_ids *ids)
 {
-	int i;
+	int i, view = -1;
+	int *hint;
 	double *v;
 	struct touch_data *touch = NULL;
+	struct touch_info *ti;
 	XIDeviceEvent *ev;
 	XGetEventData(dpy, &e->xcookie);
 
 	ev = e->xcookie.data;
-	if (ev->evtype != XI_TouchBegin &&
-	    ev->evtype != XI_TouchUpdate &&
-	    ev->evtype != XI_TouchEnd)
-		return;
+	if (!ev ||
+	    (ev->evtype != XI_TouchBegin &&
+	     ev->evtype != XI_TouchUpdate &&
+	     ev->evtype != XI_TouchEnd))
+		goto out;
+
+	for (i = 0; i < w->nviews; i++)
+		if (deviceids[i] == ev->deviceid || deviceids[i] == ev->sourceid)
+			break;
+	if (i == w->nviews)
+		goto out;
+	view = i;
+	ti = &w->views[view].frame.touch_info;
+
+	hint = &ids[view].slot[(unsigned int)ev->detail & (DIM_TOUCH_IDS - 1)];
+	if (*hint < ti->ntouches && ti->touches[*hint].active &&
+	    ti->touches[*hint].axes[AXIS_TRACKING_ID] == ev->detail)
+		touch = &ti->touches[*hint];
 
 	for (i = 0; i < ti->ntouches && touch == NULL; i++) {
 		if (!ti->touches[i].active)
 			continue;
 
-		if (ti->touches[i].data[ABS_MT_TRACKING_ID] == ev->detail)
+		if (ti->touches[i].axes[AXIS_TRACKING_ID] == ev->detail)
 			touch = &ti->touches[i];
 	}
 
 	if (touch == NULL) {
-		if (ev->evtype != XI_TouchBegin)
-			return;
+		if (ev->evtype != XI_TouchBegin) {
+			view = -1;
+			goto out;
+		}
 
 		for (i = 0; i < ti->ntouches && touch == NULL; i++) {
-			if (!ti->touches[i].active) {
+			if (!ti->touches[i].active)
 				touch = &ti->touches[i];
-				touch->data[ABS_MT_SLOT] = i;
-			}
 		}
 	}
 
 	if (touch == NULL) {
 		msg("Too many simultaneous touches. Ignoring most-recent new contact.\n");
-		return;
+		view = -1;
+		goto out;
 	}
 
+	*hint = touch - ti->touches;
+
 	/* store tracking ID in active */
 	touch->active = (ev->evtype != XI_TouchEnd);
-	touch->data[ABS_MT_POSITION_X] = ev->root_x;
-	touch->data[ABS_MT_POSITION_Y] = ev->root_y;
-	touch->data[ABS_MT_TRACKING_ID] = ev->detail;
+	touch_set(touch, AXIS_X, ev->root_x);
+	touch_set(touch, AXIS_Y, ev->root_y);
+	touch_set(touch, AXIS_TRACKING_ID, ev->detail);
 
 	v = ev->valuators.values;
 	for (i = 0; i <= ev->valuators.mask_len; i++) {
 		if (!XIMaskIsSet(ev->valuators.mask, i))
 			continue;
 		if (i == ti->x_valuator)
-			touch->data[ABS_MT_POSITION_X] = (int)*v;
+			touch_set(touch, AXIS_X, (int)*v);
 		else if (i == ti->y_valuator)
-			touch->data[ABS_MT_POSITION_Y] = (int)*v;
+			touch_set(touch, AXIS_Y, (int)*v);
 		else if (i == ti->pressure_valuator)
-			touch->data[ABS_MT_PRESSURE] = (int)*v;
+			touch_set(touch, AXIS_PRESSURE, (int)*v);
 		else if (i == ti->mt_major_valuator)
-			touch->data[ABS_MT_TOUCH_MAJOR] = (int)*v;
+			touch_set(touch, AXIS_TOUCH_MAJOR, (int)*v);
 		else if (i == ti->mt_minor_valuator)
-			touch->data[ABS_MT_TOUCH_MINOR] = (int)*v;
+			touch_set(touch, AXIS_TOUCH_MINOR, (int)*v);
 
 		v++;
 	}
 
+out:
 	XFreeEventData(dpy, &e->xcookie);
+	return view;
 }
 
-static int run_mtdev_xi2(int deviceid)
+static int run_mtdev_xi2(const int *deviceids, int ndevs,
+			 const struct options *opts)
 {
 	int major = 2, minor = 2;
 	struct windata w;
-	struct touch_info touch_info = {0};
+	struct touch_info ti[DIM_DEVICES], *touch_info[DIM_DEVICES];
+	struct touch_ids ids[DIM_DEVICES];
+	struct pacer pacer = { .fd = -1 };
+	struct fade fade = { .fd = -1 };
+	struct epoll_event ev, events[4];
 	XIEventMask mask;
 	unsigned char m[XIMaskLen(XI_LASTEVENT)] = {0};
+	int grabbed = 0, batch = 0;
+	int epfd = -1, sigfd = -1;
+	int i, n;
+	int rc = 1;
+
+	if (ndevs > DIM_DEVICES) {
+		error("At most %d devices\n", DIM_DEVICES);
+		return 1;
+	}
 
-	if (init_window(&w)) {
+	if (init_window(&w, opts)) {
 		error("Failed to open window.\n");
 		return 1;
 	}
 
 	XIQueryVersion(w.dsp, &major, &minor);
 
-	if (init_device(w.dsp, deviceid, &touch_info))
-		return 1;
+	memset(ti, 0, sizeof(ti));
+	memset(ids, 0, sizeof(ids));
+	for (i = 0; i < ndevs; i++) {
+		touch_info[i] = &ti[i];
+		if (init_device(w.dsp, deviceids[i], &ti[i]))
+			break;
+	}
+	if (i < ndevs || init_views(&w, ndevs, touch_info) || init_canvas(&w)) {
+		for (i = 0; i < ndevs; i++)
+			free(ti[i].touches);
+		goto out;
+	}
+	/* from here on the views hold the contacts */
+	for (i = 0; i < ndevs; i++)
+		free(ti[i].touches);
 
-	clear_screen(&touch_info, &w);
+	clear_screen(&w);
 
 	set_screen_size_mtdev(&w, 0);
 
+	if (pacer_init(&pacer, opts->rate) ||
+	    fade_init(&fade, &w, opts->fade, opts->rate)) {
+		error("Failed to create frame timer (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		error("Failed to create epoll fd (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	ev.events = EPOLLIN;
+	if (fade.fd >= 0) {
+		ev.data.fd = fade.fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fade.fd, &ev);
+	}
+	ev.data.fd = ConnectionNumber(w.dsp);
+	epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+	if (pacer.fd >= 0) {
+		ev.data.fd = pacer.fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, pacer.fd, &ev);
+	}
+	sigfd = latency_signal_init(&w);
+	if (sigfd >= 0) {
+		ev.data.fd = sigfd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+	}
+
 	mask.mask = m;
-	mask.deviceid = deviceid;
 	mask.mask_len = sizeof(m);
 	XISetMask(mask.mask, XI_TouchBegin);
 	XISetMask(mask.mask, XI_TouchUpdate);
 	XISetMask(mask.mask, XI_TouchEnd);
 
 	while(1) {
-		XEvent xev;
-		XNextEvent(w.dsp, &xev);
-		if (xev.type == ConfigureNotify) {
-			set_screen_size_mtdev(&w, &xev);
-		} else if (xev.type == Expose) {
-			static int grabbed = 0;
-			if (!grabbed &&
-			    XIGrabDevice(w.dsp, deviceid, w.win, CurrentTime, None,
-						GrabModeAsync, GrabModeAsync,
-						False, &mask) != Success) {
-				error("Failed to grab device\n");
-				return 1;
-			} else
+		while (XPending(w.dsp)) {
+			XEvent xev;
+			XNextEvent(w.dsp, &xev);
+			if (xev.type == ConfigureNotify) {
+				set_screen_size_mtdev(&w, &xev);
+			} else if (xev.type == Expose) {
+				damage_exposed(&w, xev.xexpose.x, xev.xexpose.y,
+					       xev.xexpose.width, xev.xexpose.height);
+				for (i = 0; !grabbed && i < ndevs; i++) {
+					mask.deviceid = deviceids[i];
+					if (XIGrabDevice(w.dsp, deviceids[i], w.win,
+							 CurrentTime, None,
+							 GrabModeAsync, GrabModeAsync,
+							 False, &mask) != Success) {
+						error("Failed to grab device %d\n",
+						      deviceids[i]);
+						goto out;
+					}
+				}
 				grabbed = 1;
+			}
+			else if (xev.type == GenericEvent) {
+				i = handle_xi2_event(w.dsp, &xev, &w, deviceids,
+						     ids);
+				if (i < 0)
+					continue;
+				if (opts->trails)
+					trail_add(&w.views[i].frame.touch_info,
+						  &w.views[i]);
+				batch = 1;
+			}
+		}
+
+		/* everything that was queued, e.g. all fingers of one
+		 * hardware frame, is rendered once */
+		if (batch && pacer_schedule(&pacer)) {
+			report_frame(&w);
+			pacer_rendered(&pacer);
 		}
-		else if (xev.type == GenericEvent) {
-			handle_xi2_event(w.dsp, &xev, &touch_info);
-			report_frame(&touch_info, &w);
+		batch = 0;
+
+		present(&w);
+
+		fade_schedule(&fade, &w);
+
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == sigfd) {
+				latency_signalled(sigfd, &w);
+			} else if (events[i].data.fd == fade.fd) {
+				fade_expired(&fade, &w);
+			} else if (events[i].data.fd == pacer.fd &&
+				   pacer_expired(&pacer)) {
+				report_frame(&w);
+				pacer_rendered(&pacer);
+			}
 		}
 	}
 
+	rc = 0;
+out:
+	if (sigfd >= 0)
+		close(sigfd);
+	if (epfd >= 0)
+		close(epfd);
+	pacer_destroy(&pacer);
+	fade_destroy(&fade);
 	term_window(&w);
 
-	return 0;
+	return rc;
 }
 
 enum mode {
 	MODE_EVDEV,
 	MODE_XI2,
+	MODE_REPLAY,
 };
 
 static void usage(void) {
-	printf("%s [--mode=evdev|xi2] [device]\n", program_invocation_short_name);
+	printf("%s [--mode=evdev|xi2|replay] [--rate=HZ] [--trails] [--fade=MS]\n"
+	       "\t[--record=FILE] [--speed=F] [--raster=cairo|sprite|auto|scalar|sse2|avx2]\n"
+	       "\t[--no-shm] [--canvas=screen|device|F] [--canvas-format=argb32|rgb16|a8]\n"
+	       "\t[--latency] [--stats] [--stats-dump=FILE] [--publish=NAME] [--no-hotplug]\n"
+	       "\t[--headless] [--size=WxH] [--dump=DIR] [--dump-format=png|raw]\n"
+	       "\t[--layout=tiled|overlay] [--name=STRING] [device...|capture...]\n",
+	       program_invocation_short_name);
+}
+
+/* A whole number >= 0 and nothing else. Returns 0 or -1 */
+static int parse_uint(const char *str, int *value)
+{
+	char *end;
+	long v;
+
+	errno = 0;
+	v = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || errno || v < 0 || v > INT_MAX)
+		return -1;
+
+	*value = v;
+	return 0;
+}
+
+/* A finite number >= 0 and nothing else. Returns 0 or -1 */
+static int parse_real(const char *str, double *value)
+{
+	char *end;
+	double v;
+
+	errno = 0;
+	v = strtod(str, &end);
+	if (end == str || *end != '\0' || errno || !isfinite(v) || !(v >= 0))
+		return -1;
+
+	*value = v;
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
 	int ret;
-	char *device = NULL;
-	int deviceid = 0;
+	char *device = NULL, *paths[DIM_DEVICES];
+	const char *match = NULL;
+	int deviceids[DIM_DEVICES];
+	int i;
 	enum mode mode = MODE_EVDEV;
+	double scale;
+	struct options opts = {
+		.width = HEADLESS_WIDTH,
+		.height = HEADLESS_HEIGHT,
+		.speed = 1.0,
+		.canvas_format = CAIRO_FORMAT_ARGB32,
+	};
 
 	while (1) {
 		static struct option long_options[] = {
 			{ "mode", required_argument, 0, 0 },
+			{ "rate", required_argument, 0, 0 },
+			{ "trails", no_argument, 0, 0 },
+			{ "headless", no_argument, 0, 0 },
+			{ "size", required_argument, 0, 0 },
+			{ "dump", required_argument, 0, 0 },
+			{ "dump-format", required_argument, 0, 0 },
+			{ "record", required_argument, 0, 0 },
+			{ "speed", required_argument, 0, 0 },
+			{ "raster", required_argument, 0, 0 },
+			{ "fade", required_argument, 0, 0 },
+			{ "no-shm", no_argument, 0, 0 },
+			{ "no-hotplug", no_argument, 0, 0 },
+			{ "latency", no_argument, 0, 0 },
+			{ "stats", no_argument, 0, 0 },
+			{ "stats-dump", required_argument, 0, 0 },
+			{ "publish", required_argument, 0, 0 },
+			{ "canvas", required_argument, 0, 0 },
+			{ "canvas-format", required_argument, 0, 0 },
+			{ "layout", required_argument, 0, 0 },
+			{ "name", required_argument, 0, 0 },
 			{ "help", no_argument, 0, 'h' },
+			{ 0, 0, 0, 0 },
 		};
 
 		int option_index = 0;
@@ -845,9 +4053,97 @@ int main(int argc, char *argv[])
 
 		switch(c) {
 			case 0:
-				if (strcmp(long_options[option_index].name, "mode") == 0 &&
-				    optarg && strcmp(optarg, "xi2") == 0)
-					mode = MODE_XI2;
+				if (strcmp(long_options[option_index].name, "mode") == 0) {
+					if (strcmp(optarg, "xi2") == 0)
+						mode = MODE_XI2;
+					else if (strcmp(optarg, "replay") == 0)
+						mode = MODE_REPLAY;
+				} else if (strcmp(long_options[option_index].name, "rate") == 0) {
+					if (parse_uint(optarg, &opts.rate)) {
+						usage();
+						return 1;
+					}
+				} else if (strcmp(long_options[option_index].name, "trails") == 0)
+					opts.trails = 1;
+				else if (strcmp(long_options[option_index].name, "headless") == 0)
+					opts.headless = 1;
+				else if (strcmp(long_options[option_index].name, "size") == 0) {
+					if (sscanf(optarg, "%dx%d", &opts.width, &opts.height) != 2 ||
+					    opts.width <= 0 || opts.height <= 0) {
+						usage();
+						return 1;
+					}
+				} else if (strcmp(long_options[option_index].name, "dump") == 0)
+					opts.dump = optarg;
+				else if (strcmp(long_options[option_index].name, "dump-format") == 0) {
+					if (strcmp(optarg, "raw") == 0)
+						opts.dump_format = DUMP_RAW;
+					else if (strcmp(optarg, "png") == 0)
+						opts.dump_format = DUMP_PNG;
+					else {
+						usage();
+						return 1;
+					}
+				} else if (strcmp(long_options[option_index].name, "record") == 0)
+					opts.record = optarg;
+				else if (strcmp(long_options[option_index].name, "raster") == 0)
+					opts.raster = optarg;
+				else if (strcmp(long_options[option_index].name, "fade") == 0) {
+					if (parse_uint(optarg, &opts.fade)) {
+						usage();
+						return 1;
+					}
+				} else if (strcmp(long_options[option_index].name, "no-shm") == 0)
+					opts.no_shm = 1;
+				else if (strcmp(long_options[option_index].name, "no-hotplug") == 0)
+					opts.no_hotplug = 1;
+				else if (strcmp(long_options[option_index].name, "name") == 0)
+					match = optarg;
+				else if (strcmp(long_options[option_index].name, "latency") == 0)
+					opts.latency = 1;
+				else if (strcmp(long_options[option_index].name, "stats") == 0)
+					opts.stats = 1;
+				else if (strcmp(long_options[option_index].name, "stats-dump") == 0)
+					opts.stats_dump = optarg;
+				else if (strcmp(long_options[option_index].name, "publish") == 0)
+					opts.publish = optarg;
+				else if (strcmp(long_options[option_index].name, "canvas") == 0) {
+					if (strcmp(optarg, "screen") == 0)
+						opts.canvas_scale = 0;
+					else if (strcmp(optarg, "device") == 0)
+						opts.canvas_scale = 1;
+					else if (parse_real(optarg, &scale) || scale <= 0) {
+						usage();
+						return 1;
+					} else
+						opts.canvas_scale = scale;
+				} else if (strcmp(long_options[option_index].name, "layout") == 0) {
+					if (strcmp(optarg, "overlay") == 0)
+						opts.layout = LAYOUT_OVERLAY;
+					else if (strcmp(optarg, "tiled") == 0)
+						opts.layout = LAYOUT_TILED;
+					else {
+						usage();
+						return 1;
+					}
+				} else if (strcmp(long_options[option_index].name, "canvas-format") == 0) {
+					if (strcmp(optarg, "rgb16") == 0)
+						opts.canvas_format = CAIRO_FORMAT_RGB16_565;
+					else if (strcmp(optarg, "a8") == 0)
+						opts.canvas_format = CAIRO_FORMAT_A8;
+					else if (strcmp(optarg, "argb32") == 0)
+						opts.canvas_format = CAIRO_FORMAT_ARGB32;
+					else {
+						usage();
+						return 1;
+					}
+				}
+				else if (strcmp(long_options[option_index].name, "speed") == 0) {
+					if (parse_real(optarg, &opts.speed)) {
+						usage();
+						return 1;
+					}
+				}
 				break;
 			case 'h':
 				usage();
@@ -859,29 +4155,73 @@ int main(int argc, char *argv[])
 
 
 	if (mode == MODE_EVDEV) {
-		if (optind < argc)
-			device = strdup(argv[optind]);
-		else
+		if (match) {
+			int n = find_devices(match, paths, DIM_DEVICES);
+
+			if (n == 0) {
+				error("No touch device matches \"%s\".\n", match);
+				return 1;
+			}
+
+			ret = run_mtdev(paths, n, &opts);
+			for (i = 0; i < n; i++)
+				free(paths[i]);
+		} else if (optind < argc) {
+			ret = run_mtdev(&argv[optind], argc - optind, &opts);
+		} else {
 			device = scan_devices();
+			if (!device) {
+			    error("Failed to find a device.\n");
+			    return 1;
+			}
 
-		if (!device) {
-		    error("Failed to find a device.\n");
-		    return 1;
+			ret = run_mtdev(&device, 1, &opts);
+			free(device);
 		}
-
-		ret = run_mtdev(device);
-		free(device);
 	} else if (mode == MODE_XI2) {
-		if (optind < argc)
-			deviceid = atoi(argv[optind]);
-		else
-			deviceid = scan_devices_xi2();
+		if (opts.headless) {
+			error("XI2 mode needs an X display.\n");
+			return 1;
+		}
+		if (opts.publish) {
+			error("XI2 mode can't publish frames.\n");
+			return 1;
+		}
+		if (opts.stats || opts.stats_dump) {
+			error("XI2 mode can't show statistics.\n");
+			return 1;
+		}
+		if (opts.latency) {
+			error("XI2 mode can't measure latency.\n");
+			return 1;
+		}
+
+		if (argc - optind > DIM_DEVICES) {
+			error("At most %d devices\n", DIM_DEVICES);
+			return 1;
+		}
 
-		if (deviceid == 0) {
+		for (i = 0; optind + i < argc; i++)
+			deviceids[i] = atoi(argv[optind + i]);
+		if (i == 0)
+			deviceids[i++] = scan_devices_xi2();
+
+		if (deviceids[0] <= 0) {
 		    error("Failed to find a device.\n");
 		    return 1;
 		}
-		ret = run_mtdev_xi2(deviceid);
+		ret = run_mtdev_xi2(deviceids, i, &opts);
+	} else if (mode == MODE_REPLAY) {
+		if (optind >= argc) {
+			error("Replay mode needs a capture file.\n");
+			return 1;
+		}
+		if (opts.record) {
+			error("Replay mode can't record.\n");
+			return 1;
+		}
+
+		ret = run_replay(&argv[optind], argc - optind, &opts);
 	}
 
 	return ret;
@@ -0,0 +1,177 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "publish.h"
+
+/* The layout readers see, all in host byte order */
+struct publish_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t header_size;	/* offset of the first frame */
+	uint32_t frame_size;
+	uint32_t nframes;
+	uint32_t nslots;
+	uint32_t naxes;
+	uint32_t reserved;
+	int32_t minx, maxx, miny, maxy;
+	_Atomic uint64_t head;	/* frames published so far */
+	char name[256];		/* of the device */
+};
+
+struct publish_frame {
+	_Atomic uint32_t seq;	/* odd while the frame is written */
+	uint32_t reserved;
+	uint64_t number;	/* of frames before this one */
+	uint64_t time;		/* ns */
+	int32_t slots[];	/* nslots of active, then naxes values */
+};
+
+#define HEADER_SIZE ((sizeof(struct publish_header) + 63) & ~63UL)
+
+struct publisher {
+	char *name;
+	void *map;
+	size_t size;
+	struct publish_header *header;
+	uint32_t frame_size;
+	int stride;		/* int32s per slot */
+	uint64_t next;		/* number of the frame being written */
+	struct publish_frame *frame;
+};
+
+struct publisher *publisher_create(const char *name, const char *device,
+				   int nslots, int naxes,
+				   int minx, int maxx, int miny, int maxy)
+{
+	struct publisher *p;
+	struct publish_header *h;
+	int fd;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return NULL;
+
+	p->name = strdup(name);
+	if (!p->name)
+		goto err;
+	p->stride = 1 + naxes;
+	p->frame_size = (sizeof(struct publish_frame) +
+			 nslots * p->stride * sizeof(int32_t) + 7) & ~7U;
+	p->size = HEADER_SIZE + (size_t)PUBLISH_FRAMES * p->frame_size;
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto err;
+	if (ftruncate(fd, p->size) != 0) {
+		close(fd);
+		shm_unlink(name);
+		goto err;
+	}
+	p->map = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      fd, 0);
+	close(fd);
+	if (p->map == MAP_FAILED) {
+		shm_unlink(name);
+		goto err;
+	}
+
+	/* the object starts out zeroed, so every sequence is even and
+	 * head says there's nothing yet */
+	h = p->header = p->map;
+	h->version = PUBLISH_VERSION;
+	h->header_size = HEADER_SIZE;
+	h->frame_size = p->frame_size;
+	h->nframes = PUBLISH_FRAMES;
+	h->nslots = nslots;
+	h->naxes = naxes;
+	h->minx = minx;
+	h->maxx = maxx;
+	h->miny = miny;
+	h->maxy = maxy;
+	strncpy(h->name, device ? device : "", sizeof(h->name) - 1);
+	/* a reader that checks the magic sees a complete header */
+	atomic_thread_fence(memory_order_release);
+	memcpy(h->magic, PUBLISH_MAGIC, sizeof(h->magic));
+
+	return p;
+
+err:
+	free(p->name);
+	free(p);
+	return NULL;
+}
+
+void publisher_begin(struct publisher *p, uint64_t time)
+{
+	struct publish_frame *f;
+	uint32_t seq;
+
+	f = (struct publish_frame *)((char *)p->map + HEADER_SIZE +
+				     (p->next % PUBLISH_FRAMES) * p->frame_size);
+	seq = atomic_load_explicit(&f->seq, memory_order_relaxed);
+	atomic_store_explicit(&f->seq, seq + 1, memory_order_relaxed);
+	/* the odd sequence is visible before any of the new contents */
+	atomic_thread_fence(memory_order_release);
+
+	f->number = p->next;
+	f->time = time;
+	p->frame = f;
+}
+
+void publisher_slot(struct publisher *p, int slot, int active,
+		    const int *axes)
+{
+	int32_t *s = &p->frame->slots[slot * p->stride];
+	int i;
+
+	s[0] = active;
+	for (i = 1; i < p->stride; i++)
+		s[i] = axes[i - 1];
+}
+
+void publisher_end(struct publisher *p)
+{
+	struct publish_frame *f = p->frame;
+	uint32_t seq = atomic_load_explicit(&f->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&f->seq, seq + 1, memory_order_release);
+	atomic_store_explicit(&p->header->head, ++p->next,
+			      memory_order_release);
+}
+
+void publisher_destroy(struct publisher *p)
+{
+	munmap(p->map, p->size);
+	shm_unlink(p->name);
+	free(p->name);
+	free(p);
+}
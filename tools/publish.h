@@ -0,0 +1,68 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include <stdint.h>
+
+/*
+ * Decoded frames in shared memory, see mtview(1) for the layout.
+ *
+ * The object holds a short header and a ring of frames, each a complete
+ * copy of every slot. Every frame has its own sequence counter that is
+ * odd while the frame is written, so readers map the object read-only,
+ * copy a frame and check the counter didn't move meanwhile. Nothing a
+ * reader does can hold up the writer, a reader that falls behind by a
+ * whole ring finds the frames it missed overwritten.
+ */
+
+#define PUBLISH_MAGIC "MTVS"
+#define PUBLISH_VERSION 1
+#define PUBLISH_FRAMES 64	/* in the ring */
+
+struct publisher;
+
+/* Creates the shared memory object name, as shm_open() takes it, for
+ * frames of nslots slots with naxes values each. The ranges are of the
+ * x and y axes. An existing object is left alone, that is EEXIST.
+ * Returns NULL and sets errno on failure */
+struct publisher *publisher_create(const char *name, const char *device,
+				   int nslots, int naxes,
+				   int minx, int maxx, int miny, int maxy);
+
+/* Starts the next frame, with the timestamp of its SYN_REPORT in ns */
+void publisher_begin(struct publisher *p, uint64_t time);
+
+/* Fills in one slot of the frame, axes holds naxes values */
+void publisher_slot(struct publisher *p, int slot, int active,
+		    const int *axes);
+
+/* Makes the frame visible to readers */
+void publisher_end(struct publisher *p);
+
+/* Unmaps and removes the object. Readers that still have it mapped
+ * keep the last frames */
+void publisher_destroy(struct publisher *p);
+
+#endif
@@ -0,0 +1,235 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "raster.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RASTER_X86 1
+#include <immintrin.h>
+#endif
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static int supported_always(void)
+{
+	return 1;
+}
+
+static void fill_span_scalar(uint32_t *dst, int n, uint32_t pixel)
+{
+	while (n-- > 0)
+		*dst++ = pixel;
+}
+
+static unsigned int sub_sat(unsigned int a, unsigned int b)
+{
+	return a > b ? a - b : 0;
+}
+
+/* Works on the distance to white, which every channel loses the same
+ * number of levels of, never going below zero */
+static uint32_t fade_span_scalar(uint32_t *dst, int n, unsigned int levels)
+{
+	uint32_t any = 0, d;
+
+	while (n-- > 0) {
+		d = ~*dst & 0x00ffffff;
+		if (d) {
+			d = sub_sat(d >> 16, levels) << 16 |
+			    sub_sat(d >> 8 & 0xff, levels) << 8 |
+			    sub_sat(d & 0xff, levels);
+			*dst = ~d;
+			any |= d;
+		}
+		dst++;
+	}
+
+	return any;
+}
+
+#ifdef RASTER_X86
+static int supported_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int supported_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/* Rows are only 4-byte aligned, the head is written a pixel at a time
+ * until the vector stores are aligned */
+__attribute__((target("sse2")))
+static void fill_span_sse2(uint32_t *dst, int n, uint32_t pixel)
+{
+	__m128i v = _mm_set1_epi32(pixel);
+
+	for (; n > 0 && ((uintptr_t)dst & 15); n--)
+		*dst++ = pixel;
+	for (; n >= 4; n -= 4, dst += 4)
+		_mm_store_si128((__m128i *)dst, v);
+	fill_span_scalar(dst, n, pixel);
+}
+
+__attribute__((target("avx2")))
+static void fill_span_avx2(uint32_t *dst, int n, uint32_t pixel)
+{
+	__m256i v = _mm256_set1_epi32(pixel);
+
+	for (; n > 0 && ((uintptr_t)dst & 31); n--)
+		*dst++ = pixel;
+	for (; n >= 16; n -= 16, dst += 16) {
+		_mm256_store_si256((__m256i *)dst, v);
+		_mm256_store_si256((__m256i *)(dst + 8), v);
+	}
+	if (n >= 8) {
+		_mm256_store_si256((__m256i *)dst, v);
+		n -= 8;
+		dst += 8;
+	}
+	fill_span_scalar(dst, n, pixel);
+}
+
+__attribute__((target("sse2")))
+static uint32_t fade_span_sse2(uint32_t *dst, int n, unsigned int levels)
+{
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	const __m128i ones = _mm_set1_epi32(-1);
+	const __m128i l = _mm_set1_epi32(levels * 0x010101);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i any = zero, d;
+
+	for (; n >= 4; n -= 4, dst += 4) {
+		d = _mm_andnot_si128(_mm_loadu_si128((__m128i *)dst), rgb);
+		d = _mm_subs_epu8(d, l);
+		any = _mm_or_si128(any, d);
+		_mm_storeu_si128((__m128i *)dst, _mm_xor_si128(d, ones));
+	}
+
+	return (_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero)) != 0xffff) |
+	       fade_span_scalar(dst, n, levels);
+}
+
+__attribute__((target("avx2")))
+static uint32_t fade_span_avx2(uint32_t *dst, int n, unsigned int levels)
+{
+	const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+	const __m256i ones = _mm256_set1_epi32(-1);
+	const __m256i l = _mm256_set1_epi32(levels * 0x010101);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i any = zero, d;
+
+	for (; n >= 8; n -= 8, dst += 8) {
+		d = _mm256_andnot_si256(_mm256_loadu_si256((__m256i *)dst), rgb);
+		d = _mm256_subs_epu8(d, l);
+		any = _mm256_or_si256(any, d);
+		_mm256_storeu_si256((__m256i *)dst, _mm256_xor_si256(d, ones));
+	}
+
+	return (_mm256_testz_si256(any, any) == 0) |
+	       fade_span_scalar(dst, n, levels);
+}
+#endif
+
+/* fastest first, "auto" takes the first one supported */
+static const struct rasterizer rasterizers[] = {
+#ifdef RASTER_X86
+	{ "avx2", supported_avx2, fill_span_avx2, fade_span_avx2 },
+	{ "sse2", supported_sse2, fill_span_sse2, fade_span_sse2 },
+#endif
+	{ "scalar", supported_always, fill_span_scalar, fade_span_scalar },
+};
+
+const struct rasterizer *raster_find(const char *name)
+{
+	unsigned int i;
+	int any = strcmp(name, "auto") == 0;
+
+	for (i = 0; i < ARRAY_SIZE(rasterizers); i++) {
+		const struct rasterizer *r = &rasterizers[i];
+
+		if ((any || strcmp(name, r->name) == 0) && r->supported())
+			return r;
+	}
+
+	return NULL;
+}
+
+void raster_fill_ellipse(const struct rasterizer *r,
+			 const struct raster_image *img,
+			 float cx, float cy, float rx, float ry,
+			 uint32_t pixel)
+{
+	int y, y0, y1, x0, x1;
+	float inv_ry, dy, dx;
+
+	if (rx <= 0 || ry <= 0)
+		return;
+
+	/* rows whose centre lies within the ellipse */
+	y0 = ceilf(cy - ry - 0.5f);
+	y1 = floorf(cy + ry - 0.5f);
+	if (y0 < 0)
+		y0 = 0;
+	if (y1 > img->height - 1)
+		y1 = img->height - 1;
+
+	inv_ry = 1.0f / ry;
+	for (y = y0; y <= y1; y++) {
+		dy = (y + 0.5f - cy) * inv_ry;
+		if (dy * dy >= 1.0f)
+			continue;
+		dx = rx * sqrtf(1.0f - dy * dy);
+
+		x0 = ceilf(cx - dx - 0.5f);
+		x1 = floorf(cx + dx - 0.5f);
+		if (x0 < 0)
+			x0 = 0;
+		if (x1 > img->width - 1)
+			x1 = img->width - 1;
+		if (x0 > x1)
+			continue;
+
+		r->fill_span((uint32_t *)(img->data + y * img->stride) + x0,
+			     x1 - x0 + 1, pixel);
+	}
+}
+
+int raster_fade(const struct rasterizer *r, const struct raster_image *img,
+		int x, int y, int w, int h, unsigned int levels)
+{
+	uint32_t any = 0;
+	int row;
+
+	for (row = y; row < y + h; row++)
+		any |= r->fade_span((uint32_t *)(img->data + row * img->stride) + x,
+				    w, levels);
+
+	return any != 0;
+}
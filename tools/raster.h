@@ -0,0 +1,69 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stdint.h>
+
+/*
+ * Filled, axis-aligned ellipses written straight into an ARGB32 image.
+ *
+ * Every contact is drawn as a solid ellipse. Cairo gets there through
+ * its general path tessellation, here each row of the ellipse is
+ * a single span and the spans are filled a vector at a time. Edges are
+ * not antialiased, a pixel is covered if its centre is inside.
+ */
+
+/* The image is not owned, the caller keeps it alive */
+struct raster_image {
+	unsigned char *data;
+	int width, height;
+	int stride;		/* bytes */
+};
+
+struct rasterizer {
+	const char *name;
+	int (*supported)(void);
+	void (*fill_span)(uint32_t *dst, int n, uint32_t pixel);
+	/* returns non-zero if any pixel is left that isn't white */
+	uint32_t (*fade_span)(uint32_t *dst, int n, unsigned int levels);
+};
+
+/* Looks up a rasterizer by name, "auto" picks the fastest the CPU
+ * supports. Returns NULL if name is unknown or not supported */
+const struct rasterizer *raster_find(const char *name);
+
+/* Fills the ellipse centred on cx/cy with radii rx/ry, clipped to the
+ * image. pixel is premultiplied ARGB32 */
+void raster_fill_ellipse(const struct rasterizer *r,
+			 const struct raster_image *img,
+			 float cx, float cy, float rx, float ry,
+			 uint32_t pixel);
+
+/* Moves every channel of every pixel in the area levels closer to
+ * opaque white. Returns 0 once the whole area is white */
+int raster_fade(const struct rasterizer *r, const struct raster_image *img,
+		int x, int y, int w, int h, unsigned int levels);
+
+#endif
@@ -0,0 +1,341 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cairo.h>
+
+#include "sprite.h"
+
+#define SPRITE_MAX 256		/* px, bigger contacts are drawn uncached */
+#define SPRITE_BUCKETS 64	/* power of two */
+
+/* Columns of a sprite row: pixels are covered from start to end,
+ * and fully opaque from opaque_start to opaque_end */
+struct sprite_row {
+	int16_t start, end;
+	int16_t opaque_start, opaque_end;
+};
+
+struct sprite {
+	/* key */
+	int w, h;
+	uint32_t pixel;
+
+	int width, height;	/* w and h plus the antialiased edge */
+	uint32_t *pixels;
+	struct sprite_row *rows;
+
+	struct sprite *next;			/* in the hash bucket */
+	struct sprite *newer, *older;		/* LRU order */
+};
+
+struct sprite_cache {
+	unsigned int capacity;
+	unsigned int nsprites;
+	struct sprite *sprites;
+	struct sprite *buckets[SPRITE_BUCKETS];
+	struct sprite *newest, *oldest;
+	struct sprite scratch;	/* for uncached draws */
+
+	struct sprite_stats stats;
+};
+
+struct sprite_cache *sprite_cache_new(unsigned int capacity)
+{
+	struct sprite_cache *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->sprites = calloc(capacity, sizeof(*c->sprites));
+	if (!c->sprites) {
+		free(c);
+		return NULL;
+	}
+	c->capacity = capacity;
+
+	return c;
+}
+
+static void sprite_free(struct sprite *s)
+{
+	free(s->pixels);
+	free(s->rows);
+	s->pixels = NULL;
+	s->rows = NULL;
+}
+
+void sprite_cache_destroy(struct sprite_cache *c)
+{
+	unsigned int i;
+
+	if (!c)
+		return;
+
+	for (i = 0; i < c->nsprites; i++)
+		sprite_free(&c->sprites[i]);
+	sprite_free(&c->scratch);
+	free(c->sprites);
+	free(c);
+}
+
+const struct sprite_stats *sprite_cache_stats(const struct sprite_cache *c)
+{
+	return &c->stats;
+}
+
+static unsigned int sprite_hash(int w, int h, uint32_t pixel)
+{
+	uint32_t k = (uint32_t)w * 0x9e3779b1u ^ (uint32_t)h * 0x85ebca77u ^
+		     pixel * 0xc2b2ae3du;
+
+	return (k ^ (k >> 16)) & (SPRITE_BUCKETS - 1);
+}
+
+static void lru_unlink(struct sprite_cache *c, struct sprite *s)
+{
+	if (s->newer)
+		s->newer->older = s->older;
+	else
+		c->newest = s->older;
+	if (s->older)
+		s->older->newer = s->newer;
+	else
+		c->oldest = s->newer;
+	s->newer = s->older = NULL;
+}
+
+static void lru_push(struct sprite_cache *c, struct sprite *s)
+{
+	s->older = c->newest;
+	s->newer = NULL;
+	if (c->newest)
+		c->newest->newer = s;
+	else
+		c->oldest = s;
+	c->newest = s;
+}
+
+static void bucket_remove(struct sprite_cache *c, struct sprite *s)
+{
+	struct sprite **p = &c->buckets[sprite_hash(s->w, s->h, s->pixel)];
+
+	while (*p && *p != s)
+		p = &(*p)->next;
+	if (*p)
+		*p = s->next;
+	s->next = NULL;
+}
+
+/* Renders the ellipse with cairo and notes the covered and opaque
+ * columns of each row */
+static int sprite_render(struct sprite *s, int w, int h, uint32_t pixel)
+{
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	int x, y;
+
+	s->w = w;
+	s->h = h;
+	s->pixel = pixel;
+	s->width = w + 2;
+	s->height = h + 2;
+
+	s->pixels = calloc(s->width * s->height, sizeof(*s->pixels));
+	s->rows = calloc(s->height, sizeof(*s->rows));
+	if (!s->pixels || !s->rows) {
+		sprite_free(s);
+		return -1;
+	}
+
+	surface = cairo_image_surface_create_for_data((unsigned char *)s->pixels,
+						      CAIRO_FORMAT_ARGB32,
+						      s->width, s->height,
+						      s->width * 4);
+	cr = cairo_create(surface);
+	cairo_set_source_rgb(cr, ((pixel >> 16) & 0xff) / 255.,
+			     ((pixel >> 8) & 0xff) / 255.,
+			     (pixel & 0xff) / 255.);
+	cairo_translate(cr, s->width / 2., s->height / 2.);
+	cairo_scale(cr, w / 2., h / 2.);
+	cairo_arc(cr, 0, 0, 1, 0, 2 * M_PI);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	cairo_surface_finish(surface);
+	cairo_surface_destroy(surface);
+
+	for (y = 0; y < s->height; y++) {
+		const uint32_t *p = s->pixels + y * s->width;
+		struct sprite_row *row = &s->rows[y];
+
+		row->start = s->width;
+		row->end = 0;
+		row->opaque_start = s->width;
+		row->opaque_end = 0;
+		for (x = 0; x < s->width; x++) {
+			if (p[x] == 0)
+				continue;
+			if (row->start == s->width)
+				row->start = x;
+			row->end = x + 1;
+			if ((p[x] >> 24) == 0xff) {
+				if (row->opaque_start == s->width)
+					row->opaque_start = x;
+				row->opaque_end = x + 1;
+			}
+		}
+		/* a convex shape, opaque pixels are a single run */
+		if (row->opaque_start > row->opaque_end)
+			row->opaque_start = row->opaque_end = row->end;
+	}
+
+	return 0;
+}
+
+/* Premultiplied OVER for n pixels */
+static void blend_span(uint32_t *dst, const uint32_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t s = src[i], d = dst[i];
+		uint32_t ia = 255 - (s >> 24);
+		uint32_t rb = (d & 0x00ff00ff) * ia + 0x00800080;
+		uint32_t ag = ((d >> 8) & 0x00ff00ff) * ia + 0x00800080;
+
+		rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+		ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+		dst[i] = s + (rb | ag);
+	}
+}
+
+static inline int clampi(int v, int lo, int hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void sprite_blit(const struct sprite *s, const struct raster_image *img,
+			float cx, float cy)
+{
+	int x0 = lrintf(cx - s->width / 2.f);
+	int y0 = lrintf(cy - s->height / 2.f);
+	/* visible sprite columns and rows */
+	int lo = clampi(-x0, 0, s->width), hi = clampi(img->width - x0, 0, s->width);
+	int ylo = clampi(-y0, 0, s->height), yhi = clampi(img->height - y0, 0, s->height);
+	int y;
+
+	for (y = ylo; y < yhi; y++) {
+		const struct sprite_row *row = &s->rows[y];
+		const uint32_t *src = s->pixels + y * s->width;
+		uint32_t *dst = (uint32_t *)(img->data + (y0 + y) * img->stride) + x0;
+		int a = clampi(row->start, lo, hi),
+		    b = clampi(row->opaque_start, lo, hi),
+		    c = clampi(row->opaque_end, lo, hi),
+		    d = clampi(row->end, lo, hi);
+
+		blend_span(dst + a, src + a, b - a);
+		memcpy(dst + b, src + b, (c - b) * sizeof(*dst));
+		blend_span(dst + c, src + c, d - c);
+	}
+}
+
+/* Finds the sprite, or makes room for it and renders it */
+static struct sprite *sprite_lookup(struct sprite_cache *c,
+				    int w, int h, uint32_t pixel)
+{
+	unsigned int bucket = sprite_hash(w, h, pixel);
+	struct sprite *s;
+
+	for (s = c->buckets[bucket]; s; s = s->next) {
+		if (s->w == w && s->h == h && s->pixel == pixel) {
+			c->stats.hits++;
+			lru_unlink(c, s);
+			lru_push(c, s);
+			return s;
+		}
+	}
+
+	c->stats.misses++;
+	if (c->nsprites < c->capacity) {
+		s = &c->sprites[c->nsprites++];
+	} else {
+		s = c->oldest;
+		lru_unlink(c, s);
+		bucket_remove(c, s);
+		sprite_free(s);
+		c->stats.evictions++;
+	}
+
+	if (sprite_render(s, w, h, pixel)) {
+		/* keep the entry, empty and first in line for eviction */
+		s->w = s->h = 0;
+		s->newer = c->oldest;
+		s->older = NULL;
+		if (c->oldest)
+			c->oldest->older = s;
+		else
+			c->newest = s;
+		c->oldest = s;
+		return NULL;
+	}
+
+	s->next = c->buckets[bucket];
+	c->buckets[bucket] = s;
+	lru_push(c, s);
+
+	return s;
+}
+
+int sprite_cache_draw(struct sprite_cache *c, const struct raster_image *img,
+		      float x, float y, float w, float h, uint32_t pixel)
+{
+	int qw = ceilf(w), qh = ceilf(h);
+	struct sprite *s;
+
+	if (qw < 1)
+		qw = 1;
+	if (qh < 1)
+		qh = 1;
+
+	if (qw > SPRITE_MAX || qh > SPRITE_MAX || c->capacity == 0) {
+		c->stats.uncached++;
+		sprite_free(&c->scratch);
+		if (sprite_render(&c->scratch, qw, qh, pixel))
+			return -1;
+		sprite_blit(&c->scratch, img, x, y);
+		return 0;
+	}
+
+	s = sprite_lookup(c, qw, qh, pixel);
+	if (!s)
+		return -1;
+
+	sprite_blit(s, img, x, y);
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef SPRITE_H
+#define SPRITE_H
+
+#include <stdint.h>
+
+#include "raster.h"
+
+/*
+ * Cache of pre-rendered contact ellipses.
+ *
+ * A contact only changes colour when a new one starts and its size
+ * drifts slowly, so most frames redraw ellipses that were drawn before.
+ * Each one is rendered once by cairo, antialiased, and later draws are
+ * a blit: the opaque middle of every row is copied, only the few edge
+ * pixels on either side are blended.
+ *
+ * Sizes are quantized to whole pixels and the position to the nearest
+ * pixel. The least recently drawn sprite makes room for a new one.
+ */
+
+struct sprite_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long uncached;	/* too big to keep */
+};
+
+struct sprite_cache;
+
+/* Holds up to capacity sprites */
+struct sprite_cache *sprite_cache_new(unsigned int capacity);
+
+void sprite_cache_destroy(struct sprite_cache *c);
+
+/* Draws a w by h ellipse centred on x/y into img, rendering and caching
+ * it first if needed. pixel is the opaque ARGB32 colour. Returns -1 if
+ * the sprite could not be rendered */
+int sprite_cache_draw(struct sprite_cache *c, const struct raster_image *img,
+		      float x, float y, float w, float h, uint32_t pixel);
+
+const struct sprite_stats *sprite_cache_stats(const struct sprite_cache *c);
+
+#endif
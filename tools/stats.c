@@ -0,0 +1,216 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#include "config.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+struct slot_stats {
+	uint64_t updates;
+	uint64_t last;		/* 0 while the slot has no contact */
+	struct running interval;
+};
+
+struct device_stats {
+	int nslots, naxes;
+
+	uint64_t nreports;
+	uint64_t first, last;	/* of the SYN_REPORTs seen */
+	struct running interval;
+	struct histogram intervals;
+
+	struct running contacts;
+	int contacts_max;
+	uint64_t *contact_frames;	/* frames with n contacts, nslots + 1 */
+
+	struct slot_stats *slots;
+	uint64_t *axis_changes;		/* naxes */
+	int *axes;			/* last values, nslots * naxes */
+};
+
+double running_stddev(const struct running *r)
+{
+	return r->n > 1 ? sqrt(r->m2 / (r->n - 1)) : 0;
+}
+
+struct device_stats *stats_new(int nslots, int naxes)
+{
+	struct device_stats *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->nslots = nslots;
+	s->naxes = naxes;
+	s->contact_frames = calloc(nslots + 1, sizeof(*s->contact_frames));
+	s->slots = calloc(nslots, sizeof(*s->slots));
+	s->axis_changes = calloc(naxes, sizeof(*s->axis_changes));
+	s->axes = calloc(nslots * naxes, sizeof(*s->axes));
+	if (!s->contact_frames || !s->slots || !s->axis_changes || !s->axes) {
+		stats_destroy(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void stats_destroy(struct device_stats *s)
+{
+	free(s->contact_frames);
+	free(s->slots);
+	free(s->axis_changes);
+	free(s->axes);
+	free(s);
+}
+
+void stats_report(struct device_stats *s, uint64_t time, int ncontacts)
+{
+	if (s->nreports == 0) {
+		s->first = time;
+	} else if (time >= s->last) {
+		running_add(&s->interval, time - s->last);
+		histogram_add(&s->intervals, time - s->last);
+	}
+	s->last = time;
+	s->nreports++;
+
+	if (ncontacts > s->nslots)
+		ncontacts = s->nslots;
+	running_add(&s->contacts, ncontacts);
+	s->contact_frames[ncontacts]++;
+	if (ncontacts > s->contacts_max)
+		s->contacts_max = ncontacts;
+}
+
+void stats_slot(struct device_stats *s, int slot, uint64_t time,
+		int active, const int *axes)
+{
+	struct slot_stats *st = &s->slots[slot];
+	int *last = &s->axes[slot * s->naxes];
+	int i;
+
+	for (i = 0; i < s->naxes; i++) {
+		if (axes[i] != last[i]) {
+			s->axis_changes[i]++;
+			last[i] = axes[i];
+		}
+	}
+
+	st->updates++;
+	/* the gap between two contacts in a slot is not an update interval */
+	if (st->last && time >= st->last)
+		running_add(&st->interval, time - st->last);
+	st->last = active ? time : 0;
+}
+
+/* Per second over the time between the first and the last report */
+static double rate(const struct device_stats *s, uint64_t n)
+{
+	uint64_t duration = s->last - s->first;
+
+	return duration ? n * 1e9 / duration : 0;
+}
+
+void stats_summarize(const struct device_stats *s, struct stats_summary *sum)
+{
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	sum->nreports = s->nreports;
+	sum->rate = s->nreports > 1 ? rate(s, s->nreports - 1) : 0;
+	sum->interval_mean = s->interval.mean;
+	sum->interval_stddev = running_stddev(&s->interval);
+	sum->interval_p50 = histogram_percentile(&s->intervals, 50);
+	sum->interval_p99 = histogram_percentile(&s->intervals, 99);
+	sum->interval_max = s->intervals.max;
+	sum->contacts_mean = s->contacts.mean;
+	sum->contacts_max = s->contacts_max;
+
+	sum->nslots = s->nslots < STATS_SUMMARY_SLOTS ?
+		      s->nslots : STATS_SUMMARY_SLOTS;
+	for (i = 0; i < sum->nslots; i++)
+		sum->slot_rate[i] = rate(s, s->slots[i].updates);
+}
+
+void stats_dump(FILE *fp, const struct device_stats *s,
+		const char *const *axis_names)
+{
+	const struct histogram *h = &s->intervals;
+	int i, sep;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"reports\": %llu,\n", (unsigned long long)s->nreports);
+	fprintf(fp, "  \"duration_s\": %.6f,\n", (s->last - s->first) / 1e9);
+	fprintf(fp, "  \"report_rate_hz\": %.3f,\n",
+		s->nreports > 1 ? rate(s, s->nreports - 1) : 0);
+	fprintf(fp, "  \"interval_us\": { \"mean\": %.3f, \"stddev\": %.3f, "
+		"\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+		"\"p99.9\": %.3f, \"max\": %.3f },\n",
+		s->interval.mean / 1e3, running_stddev(&s->interval) / 1e3,
+		h->min / 1e3,
+		histogram_percentile(h, 50) / 1e3,
+		histogram_percentile(h, 90) / 1e3,
+		histogram_percentile(h, 99) / 1e3,
+		histogram_percentile(h, 99.9) / 1e3,
+		h->max / 1e3);
+
+	fprintf(fp, "  \"contacts\": { \"mean\": %.3f, \"stddev\": %.3f, "
+		"\"max\": %d, \"frames\": [",
+		s->contacts.mean, running_stddev(&s->contacts),
+		s->contacts_max);
+	for (i = 0; i <= s->nslots; i++)
+		fprintf(fp, "%s%llu", i ? ", " : "",
+			(unsigned long long)s->contact_frames[i]);
+	fprintf(fp, "] },\n");
+
+	fprintf(fp, "  \"slots\": [");
+	for (i = 0, sep = 0; i < s->nslots; i++) {
+		const struct slot_stats *st = &s->slots[i];
+
+		if (!st->updates)
+			continue;
+		fprintf(fp, "%s\n    { \"slot\": %d, \"updates\": %llu, "
+			"\"rate_hz\": %.3f, \"interval_us_mean\": %.3f, "
+			"\"interval_us_stddev\": %.3f }",
+			sep++ ? "," : "", i,
+			(unsigned long long)st->updates, rate(s, st->updates),
+			st->interval.mean / 1e3,
+			running_stddev(&st->interval) / 1e3);
+	}
+	fprintf(fp, "%s],\n", sep ? "\n  " : "");
+
+	fprintf(fp, "  \"axis_changes\": {");
+	for (i = 0; i < s->naxes; i++)
+		fprintf(fp, "%s\n    \"%s\": { \"count\": %llu, "
+			"\"rate_hz\": %.3f }",
+			i ? "," : "", axis_names[i],
+			(unsigned long long)s->axis_changes[i],
+			rate(s, s->axis_changes[i]));
+	fprintf(fp, "%s}\n", s->naxes ? "\n  " : "");
+	fprintf(fp, "}\n");
+}
@@ -0,0 +1,94 @@
+/*****************************************************************************
+ *
+ * mtview - Multitouch Viewer (GPLv3 license)
+ *
+ * Copyright (C) 2010-2011 Canonical Ltd.
+ * Copyright (C) 2010      Henrik Rydberg <rydberg@euromail.se>
+ * Copyright © 2012 Red Hat, Inc
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+/*
+ * Report-rate and jitter statistics of a device, in constant memory.
+ *
+ * Fed once per SYN_REPORT with the frame's timestamp and once for every
+ * slot that changed in it. Intervals go into a running mean and
+ * variance and a histogram for the percentiles, nothing is kept per
+ * event.
+ */
+
+/* Running mean and variance, Welford's method */
+struct running {
+	uint64_t n;
+	double mean;
+	double m2;
+};
+
+static inline void running_add(struct running *r, double x)
+{
+	double delta = x - r->mean;
+
+	r->n++;
+	r->mean += delta / r->n;
+	r->m2 += delta * (x - r->mean);
+}
+
+double running_stddev(const struct running *r);
+
+#define STATS_SUMMARY_SLOTS 10
+
+/* What the overlay shows, times in ns and rates in Hz */
+struct stats_summary {
+	uint64_t nreports;
+	double rate;
+	double interval_mean, interval_stddev;
+	uint64_t interval_p50, interval_p99, interval_max;
+	double contacts_mean;
+	int contacts_max;
+	int nslots;		/* at most STATS_SUMMARY_SLOTS */
+	double slot_rate[STATS_SUMMARY_SLOTS];
+};
+
+struct device_stats;
+
+/* For a device with nslots slots of naxes axes each */
+struct device_stats *stats_new(int nslots, int naxes);
+
+void stats_destroy(struct device_stats *s);
+
+/* A SYN_REPORT at time ns with ncontacts active contacts. Call after
+ * stats_slot() for the slots that changed in the frame */
+void stats_report(struct device_stats *s, uint64_t time, int ncontacts);
+
+/* slot changed in the frame at time ns, axes are its values after it */
+void stats_slot(struct device_stats *s, int slot, uint64_t time,
+		int active, const int *axes);
+
+void stats_summarize(const struct device_stats *s, struct stats_summary *sum);
+
+/* Everything as one JSON object, axis_names has naxes entries */
+void stats_dump(FILE *fp, const struct device_stats *s,
+		const char *const *axis_names);
+
+#endif